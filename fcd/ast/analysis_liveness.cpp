@@ -9,22 +9,29 @@
 #include "analysis_liveness.h"
 #include "function.h"
 
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
 using namespace llvm;
 using namespace std;
 
 namespace
 {
-	LoopStatement* getParentLoop(NOT_NULL(Statement) statement)
+	const unsigned noParentLoop = numeric_limits<unsigned>::max();
+	
+	// A statement that uses or defines a variable. At each statement, the first use/def is a def if the statement
+	// defines the variable at all, since defs are sorted before uses.
+	struct UseDefPosition
 	{
-		for (Statement* parent = statement->getParent(); parent != nullptr; parent = parent->getParent())
+		unsigned index;
+		bool isUse;
+		
+		UseDefPosition(unsigned index, bool isUse)
+		: index(index), isUse(isUse)
 		{
-			if (auto loop = dyn_cast<LoopStatement>(parent))
-			{
-				return loop;
-			}
 		}
-		return nullptr;
-	}
+	};
 }
 
 unordered_set<Statement*> LivenessAnalysis::getStatements(ExpressionUse& expressionUse)
@@ -74,17 +81,21 @@ void LivenessAnalysis::collectAssignments(Statement *statement, ExpressionUser::
 	{
 		collectAssignments(statement, iter, end);
 		
-		auto result = usesDefs.insert({thisExpressionUse, {}});
+		Expression* assigned = thisExpressionUse.getUse();
+		auto result = assignableIndices.insert({assigned, static_cast<unsigned>(assignables.size())});
 		if (result.second)
 		{
-			assignedExpressions.push_back(thisExpressionUse);
-			for (ExpressionUse& use : thisExpressionUse.getUse()->uses())
+			assignables.emplace_back();
+			assignables.back().expression = assigned;
+			assignedExpressions.push_back(assigned);
+			usesDefs.emplace_back();
+			for (ExpressionUse& use : assigned->uses())
 			{
-				result.first->second.emplace_back(&use);
+				usesDefs.back().emplace_back(&use);
 			}
 		}
 		
-		for (auto& useDef : result.first->second)
+		for (auto& useDef : usesDefs[result.first->second])
 		{
 			if (useDef.get() == &thisExpressionUse)
 			{
@@ -95,7 +106,7 @@ void LivenessAnalysis::collectAssignments(Statement *statement, ExpressionUser::
 	}
 }
 
-bool LivenessAnalysis::assignmentAssigns(Statement *assignment, Expression *left, Expression *right)
+bool LivenessAnalysis::assignmentAssigns(Statement *assignment, Expression *left, Expression *right) const
 {
 	auto assignmentExpression = cast<ExpressionStatement>(assignment)->getExpression();
 	if (auto nary = dyn_cast<NAryOperatorExpression>(assignmentExpression))
@@ -112,23 +123,25 @@ bool LivenessAnalysis::assignmentAssigns(Statement *assignment, Expression *left
 	return false;
 }
 
-void LivenessAnalysis::collectStatementIndices(StatementList& list)
+void LivenessAnalysis::collectStatementIndices(StatementList& list, unsigned parentLoop)
 {
 	for (Statement* stmt : list)
 	{
-		size_t index = flatStatements.size();
-		auto result = statementStartIndices.insert({stmt, index});
+		unsigned index = static_cast<unsigned>(flatStatements.size());
+		auto result = statementIndices.insert({stmt, index});
 		assert(result.second); (void) result;
 		flatStatements.push_back(stmt);
+		statementEndIndices.push_back(index);
+		parentLoops.push_back(parentLoop);
 		
 		if (auto ifElse = dyn_cast<IfElseStatement>(stmt))
 		{
-			collectStatementIndices(ifElse->getIfBody());
-			collectStatementIndices(ifElse->getElseBody());
+			collectStatementIndices(ifElse->getIfBody(), parentLoop);
+			collectStatementIndices(ifElse->getElseBody(), parentLoop);
 		}
 		else if (auto loop = dyn_cast<LoopStatement>(stmt))
 		{
-			collectStatementIndices(loop->getLoopBody());
+			collectStatementIndices(loop->getLoopBody(), index);
 		}
 		else if (auto exprStatement = dyn_cast<ExpressionStatement>(stmt))
 		{
@@ -143,104 +156,187 @@ void LivenessAnalysis::collectStatementIndices(StatementList& list)
 			
 			// Expression statements represent statements that are not side-effect-free, and are all memory
 			// operations, whether calls, loads or stores.
-			memoryOperations.insert(index);
+			memoryOperations.push_back(index);
 		}
 		else if (!isa<KeywordStatement>(stmt))
 		{
 			llvm_unreachable("Unknown statement type!");
 		}
 		
-		result = statementEndIndices.insert({stmt, flatStatements.size()});
-		assert(result.second); (void) result;
+		statementEndIndices[index] = static_cast<unsigned>(flatStatements.size());
 	}
 }
 
-bool LivenessAnalysis::liveRangeContains(Expression *liveVariable, Statement *stmt)
+void LivenessAnalysis::computeLiveRange(Assignable& assignable)
 {
-	auto compareStatementMore = [&](size_t index, ExpressionUseRoot& statement)
-	{
-		return index > statementStartIndices.at(statement.getStatement());
-	};
+	unsigned statementCount = static_cast<unsigned>(flatStatements.size());
+	assignable.defs.resize(statementCount);
+	assignable.liveRange.resize(statementCount);
 	
-	auto compareStatementLess = [&](size_t index, ExpressionUseRoot& statement)
+	SmallVector<UseDefPosition, 16> positions;
+	for (const ExpressionUseRoot& useDef : assignable.usesDefs)
 	{
-		return index < statementStartIndices.at(statement.getStatement());
-	};
-	
-	auto& varUsers = usingStatements.at(liveVariable);
-	size_t statementIndex = statementStartIndices.at(stmt);
+		unsigned index = getStatementIndex(useDef.getStatement());
+		if (useDef.isDef())
+		{
+			assignable.defs.set(index);
+		}
+		if (positions.size() == 0 || positions.back().index != index)
+		{
+			positions.emplace_back(index, useDef.isUse());
+		}
+	}
 	
-	auto previousUseDef = upper_bound(varUsers.begin(), varUsers.end(), statementIndex, compareStatementMore);
-	auto nextUseDef = upper_bound(varUsers.begin(), varUsers.end(), statementIndex, compareStatementLess);
+	// If there is at least one def before a statement, and the next use/def after it is a use, then the live range
+	// of the variable contains this statement. (As a shortcut, if we find a use before this statement, then necessarily
+	// there also has to be a def.)
+	for (size_t i = 1; i < positions.size(); ++i)
+	{
+		if (positions[i].isUse)
+		{
+			unsigned rangeStart = i == 1 ? positions[0].index + 1 : positions[i - 1].index;
+			assignable.liveRange.set(rangeStart, positions[i].index);
+		}
+	}
 	
-	// If there is at least one def before this statement, and at least one use after this statement, then
-	// the live range of liveVariable contains this statement.
-	// (As a shortcut, if we find a use before this statement, then necessarily there also has to be a def.)
-	if (previousUseDef != varUsers.end() && nextUseDef != varUsers.end() && nextUseDef->isUse())
+	// Inside of loops, the next use/def of a statement is the next use/def in the loop body, or if there isn't any, the
+	// first use/def in the loop body, through the back edge. The use/def of the statement itself doesn't count. This
+	// is conservative with regards to break statements. Loops are numbered like the statements that they are, so
+	// visiting them in order visits outer loops before the loops that they contain, and the innermost loop whose body
+	// has a use/def of the variable has the last word.
+	SmallVector<unsigned, 8> loops;
+	for (const UseDefPosition& position : positions)
 	{
-		return true;
+		for (unsigned loop = parentLoops[position.index]; loop != noParentLoop; loop = parentLoops[loop])
+		{
+			loops.push_back(loop);
+		}
 	}
+	sort(loops.begin(), loops.end());
+	loops.erase(unique(loops.begin(), loops.end()), loops.end());
 	
-	// Linearly, there is no next use/def or the next use/def is a def. Check if stmt is inside a loop and
-	// see if the previous definition could reach a use at the start of the loop.
-	// This is conservative with regards to break statements.
-	for (auto parentLoop = getParentLoop(stmt); parentLoop != nullptr; parentLoop = getParentLoop(parentLoop))
+	BitVector loopLiveRange(statementCount);
+	auto setLoopLiveRange = [&](unsigned rangeStart, unsigned rangeEnd, bool live)
 	{
-		// See if there's a use between the original statement and the end of the loop.
-		auto useDefBeforeLoopEnd = lower_bound(varUsers.begin(), nextUseDef, statementEndIndices.at(parentLoop), [=](ExpressionUseRoot& statement, size_t index)
+		if (live)
 		{
-			return statementStartIndices.at(statement.getStatement()) < index;
-		});
-		
-		if (useDefBeforeLoopEnd != varUsers.begin())
+			loopLiveRange.set(rangeStart, rangeEnd);
+		}
+		else
 		{
-			--useDefBeforeLoopEnd;
-			if (statementStartIndices.at(useDefBeforeLoopEnd->getStatement()) > statementIndex)
-			{
-				return useDefBeforeLoopEnd->isUse();
-			}
+			loopLiveRange.reset(rangeStart, rangeEnd);
 		}
+	};
+	
+	for (unsigned loop : loops)
+	{
+		unsigned bodyEnd = statementEndIndices[loop];
+		auto bodyBegin = upper_bound(positions.begin(), positions.end(), loop, [](unsigned index, const UseDefPosition& position)
+		{
+			return index < position.index;
+		});
+		auto bodyLast = lower_bound(bodyBegin, positions.end(), bodyEnd, [](const UseDefPosition& position, unsigned index)
+		{
+			return position.index < index;
+		});
+		assert(bodyBegin != bodyLast);
+		--bodyLast;
 		
-		// See if there's a use between the start of the loop and the original statement.
-		auto useDefAfterLoopStart = upper_bound(varUsers.begin(), nextUseDef, statementStartIndices.at(parentLoop), compareStatementLess);
-		if (useDefAfterLoopStart != nextUseDef)
+		setLoopLiveRange(loop + 1, bodyBegin->index, bodyBegin->isUse);
+		for (auto iter = bodyBegin; iter != bodyLast; ++iter)
 		{
-			if (statementStartIndices.at(useDefBeforeLoopEnd->getStatement()) < statementIndex)
-			{
-				return useDefAfterLoopStart->isUse();
-			}
+			setLoopLiveRange(iter->index, (iter + 1)->index, (iter + 1)->isUse);
 		}
+		unsigned wrapStart = bodyLast == bodyBegin ? bodyLast->index + 1 : bodyLast->index;
+		setLoopLiveRange(wrapStart, bodyEnd, bodyBegin->isUse);
+	}
+	assignable.liveRange |= loopLiveRange;
+}
+
+bool LivenessAnalysis::interferenceFree(const Assignable& a, const Assignable& b) const
+{
+	// b interferes with a if it is defined where a is live, unless the definition also assigns a to b.
+	if (!a.liveRange.anyCommon(b.defs))
+	{
+		return true;
 	}
 	
-	return false;
+	for (int index = b.defs.find_first(); index != -1; index = b.defs.find_next(static_cast<unsigned>(index)))
+	{
+		Statement* statement = flatStatements[static_cast<size_t>(index)];
+		if (a.liveRange.test(static_cast<unsigned>(index)) && !assignmentAssigns(statement, b.expression, a.expression))
+		{
+			return false;
+		}
+	}
+	return true;
 }
 
-bool LivenessAnalysis::interferenceFree(Expression *a, Expression *b)
+vector<BitVector> LivenessAnalysis::getInterferenceGraph() const
 {
-	return !any_of(usingStatements.at(b), [=](ExpressionUseRoot& useDef)
+	unsigned assignableCount = static_cast<unsigned>(assignables.size());
+	vector<BitVector> graph(assignableCount, BitVector(assignableCount));
+	
+	// Two assignables interfere when one is defined where the other one is live, so only statements that define an
+	// assignable need to be considered. Find which assignables each of them defines and which are live through it.
+	BitVector definingStatements(static_cast<unsigned>(flatStatements.size()));
+	for (const Assignable& assignable : assignables)
 	{
-		if (useDef.isDef())
+		definingStatements |= assignable.defs;
+	}
+	
+	unordered_map<unsigned, pair<SmallVector<unsigned, 4>, SmallVector<unsigned, 16>>> definedAndLive;
+	for (unsigned i = 0; i < assignableCount; ++i)
+	{
+		const Assignable& assignable = assignables[i];
+		for (int index = assignable.defs.find_first(); index != -1; index = assignable.defs.find_next(static_cast<unsigned>(index)))
 		{
-			Statement* statement = useDef.getStatement();
-			return liveRangeContains(a, statement) && !assignmentAssigns(statement, b, a);
+			definedAndLive[static_cast<unsigned>(index)].first.push_back(i);
 		}
-		return false;
-	});
+		
+		BitVector liveDefinitions = assignable.liveRange;
+		liveDefinitions &= definingStatements;
+		for (int index = liveDefinitions.find_first(); index != -1; index = liveDefinitions.find_next(static_cast<unsigned>(index)))
+		{
+			definedAndLive[static_cast<unsigned>(index)].second.push_back(i);
+		}
+	}
+	
+	for (const auto& pair : definedAndLive)
+	{
+		Statement* statement = flatStatements[pair.first];
+		for (unsigned defined : pair.second.first)
+		{
+			for (unsigned live : pair.second.second)
+			{
+				if (defined != live && !assignmentAssigns(statement, assignables[defined].expression, assignables[live].expression))
+				{
+					graph[defined].set(live);
+					graph[live].set(defined);
+				}
+			}
+		}
+	}
+	return graph;
 }
 
 void LivenessAnalysis::collectStatementIndices(FunctionNode& function)
 {
+	assignables.clear();
 	assignedExpressions.clear();
-	usingStatements.clear();
-	statementStartIndices.clear();
-	statementEndIndices.clear();
+	assignableIndices.clear();
 	flatStatements.clear();
+	statementEndIndices.clear();
+	parentLoops.clear();
+	statementIndices.clear();
+	memoryOperations.clear();
 	
-	collectStatementIndices(function.getBody());
-	for (auto& pair : usesDefs)
+	collectStatementIndices(function.getBody(), noParentLoop);
+	for (size_t i = 0; i < assignables.size(); ++i)
 	{
-		auto& statements = usingStatements[pair.first];
-		for (AssignableUseDef useDef : pair.second)
+		Assignable& assignable = assignables[i];
+		auto& statements = assignable.usesDefs;
+		for (AssignableUseDef useDef : usesDefs[i])
 		{
 			auto useDefStatements = getStatements(*useDef.get());
 			assert(useDef.isUse() || useDefStatements.size() == 1);
@@ -250,10 +346,10 @@ void LivenessAnalysis::collectStatementIndices(FunctionNode& function)
 			}
 		}
 		
-		sort(statements.begin(), statements.end(), [=](ExpressionUseRoot& a, ExpressionUseRoot& b)
+		sort(statements.begin(), statements.end(), [=](const ExpressionUseRoot& a, const ExpressionUseRoot& b)
 		{
-			size_t aIndex = statementStartIndices.at(a.getStatement());
-			size_t bIndex = statementStartIndices.at(b.getStatement());
+			unsigned aIndex = getStatementIndex(a.getStatement());
+			unsigned bIndex = getStatementIndex(b.getStatement());
 			if (aIndex < bIndex)
 			{
 				 return true;
@@ -264,6 +360,8 @@ void LivenessAnalysis::collectStatementIndices(FunctionNode& function)
 			}
 			return a.isUse() < b.isUse();
 		});
+		
+		computeLiveRange(assignable);
 	}
 	
 	usesDefs.clear();
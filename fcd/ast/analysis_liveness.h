@@ -13,13 +13,14 @@
 #include "expression_use.h"
 #include "statements.h"
 
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/PointerIntPair.h>
 #include <llvm/ADT/SmallVector.h>
 
-#include <deque>
-#include <unordered_map>
 #include <unordered_set>
-#include <set>
+#include <utility>
+#include <vector>
 
 class FunctionNode;
 
@@ -50,32 +51,58 @@ public:
 	{
 	}
 	
-	Statement* getStatement() { return statement; }
+	Statement* getStatement() const { return statement; }
 };
 
+// Statements are numbered in pre-order, so that the statements nested in a statement come right after it, and
+// assignable expressions are numbered in the order that they are first assigned. Live ranges are bit vectors indexed by
+// statement number, which makes congruence checks cost a few word operations instead of a walk over live ranges.
 class LivenessAnalysis
 {
-	std::deque<Expression*> assignedExpressions;
-	std::unordered_map<Expression*, llvm::SmallVector<ExpressionUseRoot, 16>> usingStatements;
-	std::unordered_map<Statement*, size_t> statementStartIndices;
-	std::unordered_map<Statement*, size_t> statementEndIndices;
-	std::set<size_t> memoryOperations;
-	std::deque<Statement*> flatStatements;
+	struct Assignable
+	{
+		Expression* expression;
+		llvm::SmallVector<ExpressionUseRoot, 16> usesDefs;
+		llvm::BitVector defs;
+		llvm::BitVector liveRange;
+	};
+	
+	std::vector<Assignable> assignables;
+	std::vector<Expression*> assignedExpressions;
+	llvm::DenseMap<Expression*, unsigned> assignableIndices;
+	std::vector<Statement*> flatStatements;
+	std::vector<unsigned> statementEndIndices;
+	std::vector<unsigned> parentLoops;
+	llvm::DenseMap<Statement*, unsigned> statementIndices;
+	std::vector<size_t> memoryOperations;
 	
-	// intermediate dictionary, gets cleared at some point
-	std::unordered_map<Expression*, llvm::SmallVector<AssignableUseDef, 16>> usesDefs;
+	// intermediate list, indexed like assignables, gets cleared at some point
+	std::vector<llvm::SmallVector<AssignableUseDef, 16>> usesDefs;
 	
 	std::unordered_set<Statement*> getStatements(ExpressionUse& expressionUse);
 	void collectAssignments(Statement* statement, ExpressionUser::iterator iter, ExpressionUser::iterator end);
-	bool assignmentAssigns(Statement* assignment, Expression* left, Expression* right);
-	void collectStatementIndices(StatementList& list);
-	bool liveRangeContains(Expression* liveVariable, Statement* stmt);
-	bool interferenceFree(Expression* a, Expression* b);
+	bool assignmentAssigns(Statement* assignment, Expression* left, Expression* right) const;
+	void collectStatementIndices(StatementList& list, unsigned parentLoop);
+	void computeLiveRange(Assignable& assignable);
+	bool interferenceFree(const Assignable& a, const Assignable& b) const;
+	
+	unsigned getStatementIndex(Statement* statement) const
+	{
+		auto iter = statementIndices.find(statement);
+		assert(iter != statementIndices.end());
+		return iter->second;
+	}
+	
+	const Assignable& getAssignable(Expression* expression) const
+	{
+		return assignables[getAssignableIndex(expression)];
+	}
 	
 public:
 	void collectStatementIndices(FunctionNode& function);
 	
-	const std::set<size_t>& getMemoryOperations() const
+	// Indices of memory operation statements, in increasing order.
+	const std::vector<size_t>& getMemoryOperations() const
 	{
 		return memoryOperations;
 	}
@@ -87,23 +114,43 @@ public:
 	
 	std::pair<size_t, size_t> getIndex(Statement* statement) const
 	{
-		return std::make_pair(statementStartIndices.at(statement), statementEndIndices.at(statement));
+		unsigned index = getStatementIndex(statement);
+		return std::make_pair(index, statementEndIndices[index]);
 	}
 	
-	std::deque<Expression*> getAssignedExpressions() const
+	const std::vector<Expression*>& getAssignedExpressions() const
 	{
 		return assignedExpressions;
 	}
 	
+	bool isAssigned(Expression* expression) const
+	{
+		return assignableIndices.count(expression) != 0;
+	}
+	
+	// Assignables are numbered like getAssignedExpressions orders them.
+	unsigned getAssignableIndex(Expression* expression) const
+	{
+		auto iter = assignableIndices.find(expression);
+		assert(iter != assignableIndices.end());
+		return iter->second;
+	}
+	
 	const auto& getUsesDefs(Expression& expression) const
 	{
-		return usingStatements.at(&expression);
+		return getAssignable(&expression).usesDefs;
 	}
 	
-	bool congruent(Expression* a, Expression* b)
+	bool congruent(Expression* a, Expression* b) const
 	{
-		return interferenceFree(a, b) && interferenceFree(b, a);
+		const Assignable& assignableA = getAssignable(a);
+		const Assignable& assignableB = getAssignable(b);
+		return interferenceFree(assignableA, assignableB) && interferenceFree(assignableB, assignableA);
 	}
+	
+	// Row i has bit j set when assignables i and j are not congruent. This is equivalent to calling congruent() on
+	// every pair, but it only visits the statements that define something.
+	std::vector<llvm::BitVector> getInterferenceGraph() const;
 };
 
 #endif /* analysis_liveness_hpp */
@@ -11,6 +11,7 @@
 #include "expressions.h"
 #include "metadata.h"
 
+#include <llvm/ADT/Hashing.h>
 #include <llvm/IR/InstVisitor.h>
 
 #include <deque>
@@ -519,6 +520,39 @@ public:
 	}
 };
 
+// Expressions stay mutable after they are created, for instance when a pass replaces all uses of one of their operands,
+// so an entry is only a candidate. It is checked against the requested expression before it's returned.
+class AstContext::ExpressionIndex
+{
+	unordered_map<size_t, SmallVector<Expression*, 1>> buckets;
+	
+public:
+	template<typename T, typename TMatches>
+	T* find(size_t hash, TMatches&& matches)
+	{
+		auto iter = buckets.find(hash);
+		if (iter != buckets.end())
+		{
+			for (Expression* candidate : iter->second)
+			{
+				if (auto expression = dyn_cast<T>(candidate))
+				if (matches(*expression))
+				{
+					return expression;
+				}
+			}
+		}
+		return nullptr;
+	}
+	
+	template<typename T>
+	T* insert(size_t hash, T* expression)
+	{
+		buckets[hash].push_back(expression);
+		return expression;
+	}
+};
+
 void* AstContext::prepareStorageAndUses(unsigned useCount, size_t storage)
 {
 	size_t useDataSize = sizeof(ExpressionUseArrayHead) + sizeof(ExpressionUse) * useCount;
@@ -601,6 +635,93 @@ AstContext::~AstContext()
 {
 }
 
+void AstContext::setHashConsing(bool enable)
+{
+	if (!enable)
+	{
+		uniquedExpressions.reset();
+	}
+	else if (!uniquedExpressions)
+	{
+		uniquedExpressions.reset(new ExpressionIndex);
+	}
+}
+
+UnaryOperatorExpression* AstContext::uniquedUnary(UnaryOperatorExpression::UnaryOperatorType type, NOT_NULL(Expression) operand)
+{
+	// Two dereferences of the same pointer can read different values. The printer gives operators on a call result a
+	// variable of their own, so they aren't shared either.
+	if (type == UnaryOperatorExpression::Dereference || type == UnaryOperatorExpression::Increment || type == UnaryOperatorExpression::Decrement || isa<CallExpression>(static_cast<Expression*>(operand)))
+	{
+		return allocate<true, UnaryOperatorExpression>(1, type, operand);
+	}
+	
+	size_t hash = hash_combine(ExpressionUser::UnaryOperator, type, static_cast<Expression*>(operand));
+	auto existing = uniquedExpressions->find<UnaryOperatorExpression>(hash, [&](UnaryOperatorExpression& candidate)
+	{
+		return candidate.getType() == type && candidate.getOperand() == operand;
+	});
+	return existing ? existing : uniquedExpressions->insert(hash, allocate<true, UnaryOperatorExpression>(1, type, operand));
+}
+
+NAryOperatorExpression* AstContext::uniquedNary(NAryOperatorExpression::NAryOperatorType type, ArrayRef<Expression*> operands)
+{
+	auto count = static_cast<unsigned>(operands.size());
+	auto create = [&]
+	{
+		auto result = allocate<true, NAryOperatorExpression>(count, type);
+		for (unsigned i = 0; i < count; ++i)
+		{
+			setOperand(result, i, operands[i]);
+		}
+		return result;
+	};
+	
+	// Only comparisons are printed in place no matter how many uses they have.
+	if (type < NAryOperatorExpression::ComparisonMin || type >= NAryOperatorExpression::ComparisonMax)
+	{
+		return create();
+	}
+	
+	size_t hash = hash_combine(ExpressionUser::NAryOperator, type, hash_combine_range(operands.begin(), operands.end()));
+	auto existing = uniquedExpressions->find<NAryOperatorExpression>(hash, [&](NAryOperatorExpression& candidate)
+	{
+		if (candidate.getType() != type || candidate.operands_size() != count)
+		{
+			return false;
+		}
+		for (unsigned i = 0; i < count; ++i)
+		{
+			if (candidate.getOperand(i) != operands[i])
+			{
+				return false;
+			}
+		}
+		return true;
+	});
+	return existing ? existing : uniquedExpressions->insert(hash, create());
+}
+
+NumericExpression* AstContext::uniquedNumeric(const IntegerExpressionType& type, uint64_t ui)
+{
+	size_t hash = hash_combine(ExpressionUser::Numeric, &type, ui);
+	auto existing = uniquedExpressions->find<NumericExpression>(hash, [&](NumericExpression& candidate)
+	{
+		return &candidate.expressionType == &type && candidate.ui64 == ui;
+	});
+	return existing ? existing : uniquedExpressions->insert(hash, allocate<false, NumericExpression>(0, type, ui));
+}
+
+TokenExpression* AstContext::uniquedToken(const ExpressionType& type, StringRef string)
+{
+	size_t hash = hash_combine(ExpressionUser::Token, &type, hash_value(string));
+	auto existing = uniquedExpressions->find<TokenExpression>(hash, [&](TokenExpression& candidate)
+	{
+		return &candidate.expressionType == &type && string == static_cast<const char*>(candidate.token);
+	});
+	return existing ? existing : uniquedExpressions->insert(hash, allocate<false, TokenExpression>(0, type, string));
+}
+
 Expression* AstContext::uncachedExpressionFor(llvm::Value& value)
 {
 	auto iter = expressionMap.find(&value);
@@ -16,6 +16,9 @@
 #include "not_null.h"
 #include "statements.h"
 
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+
 #include <memory>
 #include <unordered_map>
 #include <utility>
@@ -37,6 +40,7 @@ class AstContext
 {
 	friend class InstToExpr;
 	class TypeIndex;
+	class ExpressionIndex;
 	
 	DumbAllocator& pool;
 	llvm::Module* module;
@@ -45,6 +49,9 @@ class AstContext
 	std::unique_ptr<TypeIndex> types;
 	std::unordered_map<const llvm::StructType*, StructExpressionType*> structTypeMap;
 	
+	// Only set when hash-consing is enabled.
+	std::unique_ptr<ExpressionIndex> uniquedExpressions;
+	
 	ExpressionReference trueExpr;
 	ExpressionReference falseExpr;
 	ExpressionReference undef;
@@ -57,6 +64,11 @@ class AstContext
 	
 	Expression* uncachedExpressionFor(llvm::Value& value);
 	
+	UnaryOperatorExpression* uniquedUnary(UnaryOperatorExpression::UnaryOperatorType type, NOT_NULL(Expression) operand);
+	NAryOperatorExpression* uniquedNary(NAryOperatorExpression::NAryOperatorType type, llvm::ArrayRef<Expression*> operands);
+	NumericExpression* uniquedNumeric(const IntegerExpressionType& type, uint64_t ui);
+	TokenExpression* uniquedToken(const ExpressionType& type, llvm::StringRef string);
+	
 	void* prepareStorageAndUses(unsigned useCount, size_t storageSize);
 	
 	template<typename T, typename... TElements>
@@ -97,6 +109,14 @@ public:
 	
 	DumbAllocator& getPool() { return pool; }
 	
+	// With hash-consing, structurally equal expressions that have no side effects and don't read memory are created
+	// once and shared. They can then be compared by address. Expressions created before it is enabled are not shared.
+	// Only expressions that the printer always writes in place are shared: tokens, numerics, comparisons and unary
+	// operators. The printer gives other expressions that have several uses a variable, which is assigned where it
+	// is first printed; sharing them between sites that don't dominate one another would read it uninitialized.
+	void setHashConsing(bool enable);
+	bool isHashConsing() const { return uniquedExpressions != nullptr; }
+	
 	Expression* expressionFor(llvm::Value& value);
 	Expression* expressionForTrue() { return trueExpr.get(); }
 	Expression* expressionForFalse() { return falseExpr.get(); }
@@ -116,6 +136,10 @@ public:
 #pragma mark - Expressions
 	UnaryOperatorExpression* unary(UnaryOperatorExpression::UnaryOperatorType type, NOT_NULL(Expression) operand)
 	{
+		if (uniquedExpressions)
+		{
+			return uniquedUnary(type, operand);
+		}
 		return allocate<true, UnaryOperatorExpression>(1, type, operand);
 	}
 	
@@ -134,6 +158,12 @@ public:
 			return *begin;
 		}
 		
+		if (uniquedExpressions)
+		{
+			llvm::SmallVector<Expression*, 4> operands(begin, end);
+			return uniquedNary(type, operands);
+		}
+		
 		auto result = nary(type, count);
 		unsigned index = 0;
 		for (auto iter = begin; iter != end; ++iter)
@@ -147,6 +177,12 @@ public:
 	template<typename... TExpressionType>
 	NAryOperatorExpression* nary(NAryOperatorExpression::NAryOperatorType type, TExpressionType&&... expressions)
 	{
+		if (uniquedExpressions)
+		{
+			Expression* operands[] = { static_cast<Expression*>(std::forward<TExpressionType>(expressions))... };
+			return uniquedNary(type, operands);
+		}
+		
 		auto result = nary(type, static_cast<unsigned>(sizeof...(TExpressionType)));
 		setOperand(result, 0, std::forward<TExpressionType>(expressions)...);
 		return result;
@@ -164,11 +200,19 @@ public:
 	
 	NumericExpression* numeric(const IntegerExpressionType& type, uint64_t ui)
 	{
+		if (uniquedExpressions)
+		{
+			return uniquedNumeric(type, ui);
+		}
 		return allocate<false, NumericExpression>(0, type, ui);
 	}
 	
 	TokenExpression* token(const ExpressionType& type, llvm::StringRef string)
 	{
+		if (uniquedExpressions)
+		{
+			return uniquedToken(type, string);
+		}
 		return allocate<false, TokenExpression>(0, type, string);
 	}
 	
@@ -23,6 +23,12 @@ using namespace std;
 
 void FunctionNode::print(llvm::raw_ostream &os)
 {
+	if (hasCachedOutput())
+	{
+		os << cachedOutput;
+		return;
+	}
+	
 	const ExpressionType& returnType = context.getType(*function.getReturnType());
 	FunctionExpressionType& functionType = context.createFunction(returnType);
 	for (Argument& arg : function.args())
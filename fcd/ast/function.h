@@ -18,6 +18,7 @@
 #include <llvm/Support/raw_ostream.h>
 
 #include <list>
+#include <string>
 #include <unordered_map>
 
 // The FunctionNode's lifetime is tied to the lifetime of its memory pool (because the lifetime of almost everything it
@@ -30,6 +31,10 @@ class FunctionNode
 	AstContext context;
 	StatementReference body;
 	
+	// Output of a previous decompilation of the same function. When it is set, the function has no body and print
+	// writes it back as is.
+	std::string cachedOutput;
+	
 public:
 	FunctionNode(llvm::Function& fn)
 	: function(fn), context(pool, fn.getParent())
@@ -48,6 +53,9 @@ public:
 	StatementList& getBody() { return *body; }
 	bool hasBody() const { return !body->empty(); }
 	
+	bool hasCachedOutput() const { return !cachedOutput.empty(); }
+	void setCachedOutput(std::string output) { cachedOutput = std::move(output); }
+	
 	void print(llvm::raw_ostream& os);
 	void dump() const;
 };
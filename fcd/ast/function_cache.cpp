@@ -0,0 +1,382 @@
+//
+// function_cache.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "capstone_wrapper.h"
+#include "function_cache.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	// Bump when the output changes for the same code, or when the way that code is keyed changes.
+	const char cacheEntryMagic[] = "fcd-function-cache-3";
+	
+	// Functions that go through more instructions than this aren't cached.
+	const size_t maxInstructionCount = 0x10000;
+	
+	bool hasGroup(const cs_detail& detail, uint8_t group)
+	{
+		auto groupsEnd = detail.groups + detail.groups_count;
+		return find(detail.groups, groupsEnd, group) != groupsEnd;
+	}
+	
+	// Follows the instructions that lifting would go through from the entry point of a function: fall-through edges
+	// and direct jumps, but not calls or returns. Instructions are keyed in address order, relative to the entry point.
+	class CodeHasher
+	{
+		const Executable& executable;
+		uint64_t entryAddress;
+		vector<uint64_t>& callees;
+		map<uint64_t, string> instructions;
+		
+		template<typename T>
+		static void addInteger(string& record, T value)
+		{
+			record.append(reinterpret_cast<const char*>(&value), sizeof value);
+		}
+		
+		static void addString(string& record, StringRef str)
+		{
+			addInteger(record, static_cast<uint64_t>(str.size()));
+			record.append(str.begin(), str.end());
+		}
+		
+		// References that leave the function are keyed on what the output prints for them.
+		void addReference(string& record, uint64_t address)
+		{
+			if (const StubInfo* stub = executable.getStubTarget(address))
+			{
+				addString(record, "import");
+				addString(record, stub->name);
+			}
+			else if (const SymbolInfo* symbol = executable.getInfo(address))
+			{
+				if (symbol->name.empty())
+				{
+					addString(record, "address");
+					addInteger(record, address);
+				}
+				else
+				{
+					addString(record, "symbol");
+					addString(record, symbol->name);
+				}
+			}
+			else
+			{
+				addString(record, "address");
+				addInteger(record, address);
+			}
+		}
+		
+		// Memory that the function reads can be folded into the output, so the bytes that it loads are part of the key.
+		void addMemory(string& record, uint64_t address, size_t size)
+		{
+			addReference(record, address);
+			const uint8_t* begin = executable.map(address);
+			if (begin != nullptr && size <= static_cast<size_t>(executable.end() - begin))
+			{
+				record.append(reinterpret_cast<const char*>(begin), size);
+			}
+		}
+		
+		bool addInstruction(string& record, const cs_insn& inst, SmallVectorImpl<uint64_t>& successors)
+		{
+			const cs_detail& detail = *inst.detail;
+			const cs_x86& x86 = detail.x86;
+			uint64_t nextAddress = inst.address + inst.size;
+			addInteger(record, inst.id);
+			addInteger(record, inst.size);
+			record.append(reinterpret_cast<const char*>(x86.prefix), sizeof x86.prefix);
+			record.append(reinterpret_cast<const char*>(x86.opcode), sizeof x86.opcode);
+			addInteger(record, x86.rex);
+			addInteger(record, x86.addr_size);
+			addInteger(record, x86.modrm);
+			
+			if (hasGroup(detail, CS_GRP_RET) || hasGroup(detail, CS_GRP_IRET))
+			{
+				return true;
+			}
+			
+			bool isJump = hasGroup(detail, CS_GRP_JUMP);
+			bool isCall = hasGroup(detail, CS_GRP_CALL);
+			if ((isJump || isCall) && x86.op_count == 1 && x86.operands[0].type == X86_OP_IMM)
+			{
+				uint64_t target = static_cast<uint64_t>(x86.operands[0].imm);
+				if (isCall)
+				{
+					callees.push_back(target);
+					addString(record, "call");
+					addReference(record, target);
+				}
+				else if (executable.getStubTarget(target) != nullptr)
+				{
+					// Jumps to imports are tail calls.
+					addString(record, "tail call");
+					addReference(record, target);
+					return true;
+				}
+				else
+				{
+					addString(record, "jump");
+					addInteger(record, target - entryAddress);
+					successors.push_back(target);
+					if (inst.id == X86_INS_JMP)
+					{
+						return true;
+					}
+				}
+				successors.push_back(nextAddress);
+				return true;
+			}
+			else if (isJump)
+			{
+				// Where indirect jumps go depends on memory that isn't followed.
+				return false;
+			}
+			
+			addInteger(record, x86.op_count);
+			for (uint8_t i = 0; i < x86.op_count; ++i)
+			{
+				const cs_x86_op& op = x86.operands[i];
+				addInteger(record, op.type);
+				addInteger(record, op.size);
+				if (op.type == X86_OP_REG)
+				{
+					addInteger(record, op.reg);
+				}
+				else if (op.type == X86_OP_IMM)
+				{
+					addInteger(record, op.imm);
+				}
+				else if (op.type == X86_OP_MEM)
+				{
+					addInteger(record, op.mem.segment);
+					addInteger(record, op.mem.base);
+					addInteger(record, op.mem.index);
+					addInteger(record, op.mem.scale);
+					bool isRipRelative = op.mem.base == X86_REG_RIP && op.mem.index == X86_REG_INVALID;
+					bool isAbsolute = op.mem.base == X86_REG_INVALID && op.mem.index == X86_REG_INVALID;
+					if (isRipRelative || isAbsolute)
+					{
+						uint64_t target = static_cast<uint64_t>(op.mem.disp);
+						if (isRipRelative)
+						{
+							target += nextAddress;
+						}
+						
+						if (inst.id == X86_INS_LEA)
+						{
+							addReference(record, target);
+						}
+						else
+						{
+							addMemory(record, target, op.size);
+						}
+					}
+					else
+					{
+						addInteger(record, op.mem.disp);
+					}
+				}
+			}
+			successors.push_back(nextAddress);
+			return true;
+		}
+	
+	public:
+		CodeHasher(const Executable& executable, uint64_t entryAddress, vector<uint64_t>& callees)
+		: executable(executable), entryAddress(entryAddress), callees(callees)
+		{
+		}
+		
+		string hashFunction(StringRef pipeline)
+		{
+			auto csOrError = capstone::create(CS_ARCH_X86, static_cast<unsigned>(CS_MODE_LITTLE_ENDIAN | CS_MODE_64));
+			if (!csOrError)
+			{
+				return string();
+			}
+			
+			capstone& cs = csOrError.get();
+			auto inst = cs.alloc();
+			SmallVector<uint64_t, 16> toVisit = { entryAddress };
+			while (!toVisit.empty())
+			{
+				uint64_t address = toVisit.pop_back_val();
+				auto result = instructions.insert({address, string()});
+				if (!result.second)
+				{
+					continue;
+				}
+				if (instructions.size() > maxInstructionCount)
+				{
+					return string();
+				}
+				
+				// Lifting stops at addresses that can't be decoded as well.
+				string& record = result.first->second;
+				const uint8_t* begin = executable.map(address);
+				if (begin == nullptr || !cs.disassemble(inst.get(), begin, executable.end(), address))
+				{
+					addString(record, "invalid");
+				}
+				else if (!addInstruction(record, *inst, toVisit))
+				{
+					return string();
+				}
+			}
+			
+			MD5 hash;
+			string header;
+			addString(header, cacheEntryMagic);
+			addString(header, pipeline);
+			addReference(header, entryAddress);
+			hash.update(header);
+			for (const auto& pair : instructions)
+			{
+				string offset;
+				addInteger(offset, pair.first - entryAddress);
+				addInteger(offset, static_cast<uint64_t>(pair.second.size()));
+				hash.update(offset);
+				hash.update(pair.second);
+			}
+			
+			MD5::MD5Result result;
+			hash.final(result);
+			SmallString<32> digest;
+			MD5::stringifyResult(result, digest);
+			return digest.str();
+		}
+	};
+}
+
+FunctionCache::FunctionCache(string directory)
+: directory(move(directory)), hits(0), misses(0)
+{
+}
+
+string FunctionCache::getEntryPath(StringRef key) const
+{
+	// Entries are spread across subdirectories so that no directory gets too large.
+	SmallString<128> path(directory);
+	sys::path::append(path, key.substr(0, 2), key);
+	return path.str();
+}
+
+string FunctionCache::getKey(const Executable& executable, uint64_t address, StringRef pipeline, vector<uint64_t>& callees) const
+{
+	callees.clear();
+	string key = CodeHasher(executable, address, callees).hashFunction(pipeline);
+	sort(callees.begin(), callees.end());
+	callees.erase(unique(callees.begin(), callees.end()), callees.end());
+	return key;
+}
+
+bool FunctionCache::lookup(StringRef key, Entry& entry) const
+{
+	auto bufferOrError = MemoryBuffer::getFile(getEntryPath(key));
+	if (!bufferOrError)
+	{
+		return false;
+	}
+	
+	// Entries are the magic line, call information lines, an empty line and the pseudocode.
+	StringRef line, contents;
+	tie(line, contents) = bufferOrError.get()->getBuffer().split('\n');
+	if (line != cacheEntryMagic)
+	{
+		return false;
+	}
+	
+	entry = Entry();
+	for (tie(line, contents) = contents.split('\n'); !line.empty(); tie(line, contents) = contents.split('\n'))
+	{
+		SmallVector<StringRef, 3> fields;
+		line.split(fields, '\t');
+		uint64_t calleeAddress;
+		if (fields.size() == 2 && fields[0] == "callinfo")
+		{
+			entry.callInformation = fields[1].str();
+		}
+		else if (fields.size() == 3 && fields[0] == "callee" && !fields[1].getAsInteger(16, calleeAddress))
+		{
+			entry.calleeCallInformation[calleeAddress] = fields[2].str();
+		}
+		else
+		{
+			return false;
+		}
+	}
+	entry.output = contents.str();
+	return true;
+}
+
+bool FunctionCache::store(StringRef key, const Entry& entry)
+{
+	string entryPath = getEntryPath(key);
+	if (sys::fs::create_directories(sys::path::parent_path(entryPath)))
+	{
+		return false;
+	}
+	
+	// Write to a temporary file and move it in place, so that concurrent fcd processes never see a partial entry.
+	int fd;
+	SmallString<128> tempPath;
+	if (sys::fs::createUniqueFile(entryPath + "-%%%%%%%%", fd, tempPath))
+	{
+		return false;
+	}
+	
+	bool written;
+	{
+		raw_fd_ostream entryOutput(fd, true);
+		entryOutput << cacheEntryMagic << '\n';
+		entryOutput << "callinfo\t" << entry.callInformation << '\n';
+		for (const auto& pair : entry.calleeCallInformation)
+		{
+			entryOutput << "callee\t";
+			entryOutput.write_hex(pair.first);
+			entryOutput << '\t' << pair.second << '\n';
+		}
+		entryOutput << '\n' << entry.output;
+		entryOutput.close();
+		written = !entryOutput.has_error();
+		entryOutput.clear_error();
+	}
+	
+	if (!written || sys::fs::rename(tempPath, entryPath))
+	{
+		sys::fs::remove(tempPath);
+		return false;
+	}
+	return true;
+}
+
+void FunctionCache::printStatistics(raw_ostream& os) const
+{
+	size_t hitCount = hits;
+	size_t missCount = misses;
+	os << "function cache: " << hitCount << " hits, " << missCount << " misses";
+	if (hitCount + missCount > 0)
+	{
+		os << " (" << (hitCount * 100 / (hitCount + missCount)) << "% hit rate)";
+	}
+	os << '\n';
+}
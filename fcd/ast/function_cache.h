@@ -0,0 +1,63 @@
+//
+// function_cache.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__ast_function_cache_h
+#define fcd__ast_function_cache_h
+
+#include "executable.h"
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+// Keeps the pseudocode of functions on disk between runs. Entries are keyed on the instructions that lifting goes
+// through from the entry point of a function, read from the executable before anything is lifted, with addresses
+// normalized so that a function that only moved from one build to the next hits the cache. Branches within the
+// function are keyed relative to its entry point; what the output prints, like the names of callees and the addresses
+// of globals, is keyed as is. An entry also records the call information that was recovered for the function and for
+// each function that it calls, and is only valid while these stay the same. Methods can be called from several threads
+// and several processes at once.
+class FunctionCache
+{
+	std::string directory;
+	std::atomic<size_t> hits;
+	std::atomic<size_t> misses;
+	
+	std::string getEntryPath(llvm::StringRef key) const;
+	
+public:
+	struct Entry
+	{
+		// Call information as printed by CallInformation::print. Callees are identified by their address.
+		std::string callInformation;
+		std::map<uint64_t, std::string> calleeCallInformation;
+		std::string output;
+	};
+	
+	FunctionCache(std::string directory);
+	
+	// pipeline identifies whatever changes the output without changing the code of the function, like headers and
+	// passes. Returns an empty key when the function can't be cached, like when it has indirect jumps. callees receives
+	// the addresses that the function calls directly.
+	std::string getKey(const Executable& executable, uint64_t address, llvm::StringRef pipeline, std::vector<uint64_t>& callees) const;
+	bool lookup(llvm::StringRef key, Entry& entry) const;
+	bool store(llvm::StringRef key, const Entry& entry);
+	
+	void addHit() { ++hits; }
+	void addMiss() { ++misses; }
+	size_t getHitCount() const { return hits; }
+	size_t getMissCount() const { return misses; }
+	void printStatistics(llvm::raw_ostream& os) const;
+};
+
+#endif /* fcd__ast_function_cache_h */
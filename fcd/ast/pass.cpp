@@ -51,12 +51,15 @@ void AstFunctionPass::doRun(deque<unique_ptr<FunctionNode>>& list)
 {
 	for (unique_ptr<FunctionNode>& funcNode : list)
 	{
-		if (runOnDeclarations || funcNode->hasBody())
-		{
-			PrettyStackTraceFormat runPass("Running AST pass \"%s\" on function \"%s\"", getName(), string(funcNode->getFunction().getName()).c_str());
-			
-			this->fn = funcNode.get();
-			doRun(*funcNode);
-		}
+		runOnFunction(*funcNode);
+	}
+}
+
+void AstFunctionPass::runOnFunction(FunctionNode& funcNode)
+{
+	if (runOnDeclarations || funcNode.hasBody())
+	{
+		PrettyStackTraceFormat runPass("Running AST pass \"%s\" on function \"%s\"", getName(), string(funcNode.getFunction().getName()).c_str());
+		doRun(funcNode);
 	}
 }
@@ -26,18 +26,22 @@ protected:
 	
 public:
 	virtual const char* getName() const = 0;
+	virtual bool isFunctionPass() const { return false; }
+	
+	// Module passes that look at functions one at a time, in order, can be run several times on consecutive slices of
+	// the module. This lets the back-end free functions as soon as they're done.
+	virtual bool canRunOnSlices() const { return false; }
 	void run(std::deque<std::unique_ptr<FunctionNode>>& functions);
 	virtual ~AstModulePass() = default;
 };
 
+// Function passes only ever see one FunctionNode at a time and must not keep state between invocations of
+// doRun(FunctionNode&): the back-end may run the same pass object on several functions concurrently.
 class AstFunctionPass : public AstModulePass
 {
-	FunctionNode* fn;
 	bool runOnDeclarations;
 	
 protected:
-	AstContext& context() { return fn->getContext(); }
-	
 	virtual void doRun(std::deque<std::unique_ptr<FunctionNode>>& function) override final;
 	virtual void doRun(FunctionNode& function) = 0;
 	
@@ -47,6 +51,9 @@ public:
 	{
 	}
 	
+	virtual bool isFunctionPass() const override final { return true; }
+	void runOnFunction(FunctionNode& function);
+	
 	virtual ~AstFunctionPass() = default;
 };
 
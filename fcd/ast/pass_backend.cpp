@@ -7,6 +7,8 @@
 // license. See LICENSE.md for details.
 //
 
+#include "command_line.h"
+#include "function_cache.h"
 #include "metadata.h"
 #include "pass_backend.h"
 #include "passes.h"
@@ -14,14 +16,22 @@
 
 #include <llvm/ADT/PostOrderIterator.h>
 #include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Analysis/DominanceFrontierImpl.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Support/raw_os_ostream.h>
 
 #include <algorithm>
 #include <deque>
+#include <functional>
 #include <list>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 using namespace llvm;
@@ -29,15 +39,42 @@ using namespace std;
 
 namespace
 {
-	uint64_t getVirtualAddress(FunctionNode& node)
+	cl::opt<bool> hashConsExpressions("hash-cons-ast", cl::desc("Share structurally equal constants, tokens, comparisons and unary operators in the AST"), whitelist());
+	
+	uint64_t getVirtualAddress(Function& fn)
 	{
-		if (auto address = md::getVirtualAddress(node.getFunction()))
+		if (auto address = md::getVirtualAddress(fn))
 		{
 			return address->getLimitedValue();
 		}
 		return 0;
 	}
 	
+	StringRef getCallInformationString(const Function& fn)
+	{
+		auto callInfo = md::getRecoveredCallInformation(fn);
+		return callInfo == nullptr ? StringRef() : callInfo->getString();
+	}
+	
+	// Call information of the lifted functions that fn calls, by address, as the function cache records it.
+	map<uint64_t, string> getCalleeCallInformation(Function& fn)
+	{
+		map<uint64_t, string> result;
+		for (BasicBlock& block : fn)
+		{
+			for (Instruction& inst : block)
+			{
+				if (auto call = dyn_cast<CallInst>(&inst))
+				if (Function* callee = call->getCalledFunction())
+				if (md::getRecoveredCallInformation(*callee) != nullptr)
+				{
+					result[getVirtualAddress(*callee)] = getCallInformationString(*callee).str();
+				}
+			}
+		}
+		return result;
+	}
+	
 	struct DfsStackItem
 	{
 		PreAstBasicBlock& block;
@@ -103,7 +140,7 @@ namespace
 	
 	bool derefEqual(const Expression* a, const Expression* b)
 	{
-		return *a == *b;
+		return a == b || *a == *b;
 	}
 	
 	bool areOpposites(const Expression& a, const Expression& b)
@@ -814,8 +851,99 @@ namespace
 char AstBackEnd::ID = 0;
 static RegisterPass<AstBackEnd> astBackEnd("-ast-backend", "Produce AST from LLVM module");
 
-AstBackEnd::AstBackEnd()
-: ModulePass(ID)
+namespace
+{
+	void structurizeFunction(FunctionNode& result, PreAstContext& blockGraph)
+	{
+		// Ensure that loops all have an exit node, for the sake of the post-dominator tree.
+		ensureLoopsExit(blockGraph);
+		
+		// Compute regions.
+		PreAstBasicBlockRegionTraits::DomTreeT domTree(false);
+		PreAstBasicBlockRegionTraits::PostDomTreeT postDomTree(true);
+		PreAstBasicBlockRegionTraits::DomFrontierT dominanceFrontier;
+		domTree.recalculate(blockGraph);
+		postDomTree.recalculate(blockGraph);
+		dominanceFrontier.analyze(domTree);
+		Structurizer structurizer(blockGraph, domTree, postDomTree, dominanceFrontier);
+		result.getBody() = structurizer.structurizeFunction().take();
+	}
+}
+
+namespace
+{
+	// Destroying the last timer of a group prints the group and drops its times, so the "ast" timers are shared by
+	// every back-end and outlive them; back-ends that run the same pipeline add up to the same timers.
+	class AstTimers
+	{
+		TimerGroup group;
+		deque<Timer> timers;
+		StringMap<Timer*> timersByName;
+		mutex timersMutex;
+		
+	public:
+		AstTimers()
+		: group("ast", "AST pass execution timing report")
+		{
+		}
+		
+		Timer& get(StringRef name, StringRef description)
+		{
+			lock_guard<mutex> lock(timersMutex);
+			Timer*& timer = timersByName[name];
+			if (timer == nullptr)
+			{
+				timers.emplace_back(name, description, group);
+				timer = &timers.back();
+			}
+			return *timer;
+		}
+	};
+	
+	ManagedStatic<AstTimers> astTimers;
+}
+
+// Runs tasks on a thread pool, or right away on the calling thread when there is a single job.
+class AstBackEnd::TaskScheduler
+{
+	unique_ptr<ThreadPool> workers;
+	unsigned workerCount;
+	
+public:
+	TaskScheduler(unsigned jobCount)
+	: workerCount(jobCount == 0 ? max(thread::hardware_concurrency(), 1u) : jobCount)
+	{
+		if (workerCount > 1)
+		{
+			workers.reset(new ThreadPool(workerCount));
+		}
+	}
+	
+	unsigned getWorkerCount() const { return workerCount; }
+	
+	void schedule(function<void()> task)
+	{
+		if (workers)
+		{
+			workers->async(move(task));
+		}
+		else
+		{
+			task();
+		}
+	}
+	
+	void wait()
+	{
+		if (workers)
+		{
+			workers->wait();
+		}
+	}
+};
+
+AstBackEnd::AstBackEnd(unsigned jobCount)
+: ModulePass(ID), jobCount(jobCount), cache(nullptr)
 {
 }
 
@@ -834,22 +962,169 @@ void AstBackEnd::addPass(AstModulePass *pass)
 	passes.emplace_back(pass);
 }
 
-bool AstBackEnd::runOnModule(llvm::Module &m)
+void AstBackEnd::createTimers()
+{
+	// Timer names are used as keys in the JSON report, so passes that appear more than once in the pipeline are told
+	// apart by their position.
+	timers.push_back(&astTimers->get("structurize", "Structurization"));
+	for (size_t i = 0; i < passes.size(); ++i)
+	{
+		string name;
+		raw_string_ostream(name) << i << '.' << passes[i]->getName();
+		timers.push_back(&astTimers->get(name, passes[i]->getName()));
+	}
+}
+
+string AstBackEnd::getPipelineIdentity() const
 {
-	outputNodes.clear();
+	string identity;
+	raw_string_ostream identityStream(identity);
+	for (const auto& pass : passes)
+	{
+		identityStream << pass->getName() << '\n';
+	}
+	if (hashConsExpressions)
+	{
+		// Results from when every side-effect-free expression was shared can read uninitialized variables.
+		identityStream << "hash-cons-2\n";
+	}
+	return identityStream.str();
+}
+
+void AstBackEnd::runOnFunctions(ArrayRef<Function*> functions)
+{
+	vector<pair<FunctionNode*, string>> uncachedFunctions;
 	
-	for (Function& fn : m)
+	// Creating FunctionNodes and block graphs reads LLVM values and can create LLVM types and constants, which is not
+	// thread-safe, so it happens on this thread. Structurizing only touches the function's own AstContext and can be
+	// handed off to workers as soon as the block graph is ready.
+	{
+		TimeRegion structurizeTime(timers.empty() ? nullptr : timers[0]);
+		deque<unique_ptr<PreAstContext>> blockGraphs;
+		for (Function* fn : functions)
+		{
+			outputNodes.emplace_back(new FunctionNode(*fn));
+			outputNodes.back()->getContext().setHashConsing(hashConsExpressions);
+			FunctionNode* result = outputNodes.back().get();
+			bool isPrototype = md::isPrototype(*fn);
+			auto cachedOutput = cachedOutputs.find(getVirtualAddress(*fn));
+			if (cachedOutput != cachedOutputs.end())
+			{
+				// Functions that a later round of lifting rediscovered have a body, and their parameters were recovered
+				// again; their entry is only used once its call information is checked below.
+				string output = move(cachedOutput->second);
+				cachedOutputs.erase(cachedOutput);
+				if (isPrototype)
+				{
+					result->setCachedOutput(move(output));
+					if (cache != nullptr)
+					{
+						cache->addHit();
+					}
+					continue;
+				}
+			}
+			
+			if (!isPrototype)
+			{
+				if (cache != nullptr)
+				if (auto key = md::getCacheKey(*fn))
+				{
+					// Entries only hold while the function and its callees have the same call information as when
+					// they were stored.
+					FunctionCache::Entry entry;
+					if (cache->lookup(key->getString(), entry))
+					if (entry.callInformation == getCallInformationString(*fn))
+					if (entry.calleeCallInformation == getCalleeCallInformation(*fn))
+					{
+						result->setCachedOutput(move(entry.output));
+						cache->addHit();
+						continue;
+					}
+					cache->addMiss();
+					uncachedFunctions.emplace_back(result, key->getString());
+				}
+				
+				blockGraphs.emplace_back(new PreAstContext(result->getContext()));
+				unique_ptr<PreAstContext>* blockGraph = &blockGraphs.back();
+				(*blockGraph)->generateBlocks(*fn);
+				scheduler->schedule([=]
+				{
+					structurizeFunction(*result, **blockGraph);
+					blockGraph->reset();
+				});
+			}
+		}
+		scheduler->wait();
+	}
+	
+	// run passes; consecutive function passes run as one chain per function so that functions can be processed
+	// independently. When timing passes, chains are cut down to a single pass so that each pass gets its own time.
+	auto passIter = passes.begin();
+	while (passIter != passes.end())
+	{
+		TimeRegion passTime(timers.empty() ? nullptr : timers[size_t(passIter - passes.begin()) + 1]);
+		if (!(*passIter)->isFunctionPass())
+		{
+			(*passIter)->run(outputNodes);
+			++passIter;
+			continue;
+		}
+		
+		auto chainEnd = !timers.empty() ? passIter + 1 : find_if(passIter, passes.end(), [](unique_ptr<AstModulePass>& pass)
+		{
+			return !pass->isFunctionPass();
+		});
+		
+		for (unique_ptr<FunctionNode>& node : outputNodes)
+		{
+			FunctionNode* function = node.get();
+			scheduler->schedule([=]
+			{
+				for (auto& pass : make_range(passIter, chainEnd))
+				{
+					static_cast<AstFunctionPass&>(*pass).runOnFunction(*function);
+				}
+			});
+		}
+		scheduler->wait();
+		passIter = chainEnd;
+	}
+	
+	for (auto& pair : uncachedFunctions)
 	{
-		outputNodes.emplace_back(new FunctionNode(fn));
-		output = outputNodes.back().get();
-		if (!md::isPrototype(fn))
+		if (!pair.first->hasBody())
 		{
-			runOnFunction(fn);
+			continue;
 		}
+		
+		Function& fn = pair.first->getFunction();
+		FunctionCache::Entry entry;
+		entry.callInformation = getCallInformationString(fn).str();
+		entry.calleeCallInformation = getCalleeCallInformation(fn);
+		raw_string_ostream outputStream(entry.output);
+		pair.first->print(outputStream);
+		outputStream.flush();
+		cache->store(pair.second, entry);
+	}
+}
+
+bool AstBackEnd::runOnModule(llvm::Module &m)
+{
+	scheduler.reset(new TaskScheduler(jobCount));
+	if (TimePassesIsEnabled && timers.empty())
+	{
+		createTimers();
+	}
+	
+	// sort functions by virtual address, then by name
+	vector<Function*> functions;
+	for (Function& fn : m)
+	{
+		functions.push_back(&fn);
 	}
 	
-	// sort outputNodes by virtual address, then by name
-	sort(outputNodes.begin(), outputNodes.end(), [](unique_ptr<FunctionNode>& a, unique_ptr<FunctionNode>& b)
+	sort(functions.begin(), functions.end(), [](Function* a, Function* b)
 	{
 		auto virtA = getVirtualAddress(*a);
 		auto virtB = getVirtualAddress(*b);
@@ -859,7 +1134,7 @@ bool AstBackEnd::runOnModule(llvm::Module &m)
 		}
 		else if (virtA == virtB)
 		{
-			return a->getFunction().getName() < b->getFunction().getName();
+			return a->getName() < b->getName();
 		}
 		else
 		{
@@ -867,38 +1142,33 @@ bool AstBackEnd::runOnModule(llvm::Module &m)
 		}
 	});
 	
-	// run passes
-	for (auto& pass : passes)
+	// Unless a module pass needs to see every function at once, functions go through the back-end a few at a time and
+	// are freed as soon as they have been printed, so that memory use follows the size of the largest functions
+	// instead of the size of the program. Slices are large enough to keep every worker busy.
+	size_t sliceSize = functions.size();
+	bool canRunOnSlices = all_of(passes.begin(), passes.end(), [](unique_ptr<AstModulePass>& pass)
+	{
+		return pass->isFunctionPass() || pass->canRunOnSlices();
+	});
+	if (canRunOnSlices)
+	{
+		unsigned workerCount = scheduler->getWorkerCount();
+		sliceSize = workerCount > 1 ? workerCount * 4 : 1;
+	}
+	
+	for (size_t begin = 0; begin < functions.size(); begin += sliceSize)
 	{
-		pass->run(outputNodes);
+		size_t count = min(sliceSize, functions.size() - begin);
+		runOnFunctions(makeArrayRef(functions).slice(begin, count));
+		outputNodes.clear();
 	}
+	cachedOutputs.clear();
 	
+	scheduler.reset();
 	return false;
 }
 
-void AstBackEnd::runOnFunction(Function& fn)
-{
-	// Create AST block graph.
-	outputNodes.emplace_back(new FunctionNode(fn));
-	FunctionNode& result = *outputNodes.back();
-	blockGraph.reset(new PreAstContext(result.getContext()));
-	blockGraph->generateBlocks(fn);
-	
-	// Ensure that loops all have an exit node, for the sake of the post-dominator tree.
-	ensureLoopsExit(*blockGraph);
-	
-	// Compute regions.
-	PreAstBasicBlockRegionTraits::DomTreeT domTree(false);
-	PreAstBasicBlockRegionTraits::PostDomTreeT postDomTree(true);
-	PreAstBasicBlockRegionTraits::DomFrontierT dominanceFrontier;
-	domTree.recalculate(*blockGraph);
-	postDomTree.recalculate(*blockGraph);
-	dominanceFrontier.analyze(domTree);
-	Structurizer structurizer(*blockGraph, domTree, postDomTree, dominanceFrontier);
-	result.getBody() = structurizer.structurizeFunction().take();
-}
-
-AstBackEnd* createAstBackEnd()
+AstBackEnd* createAstBackEnd(unsigned jobCount)
 {
-	return new AstBackEnd;
+	return new AstBackEnd(jobCount);
 }
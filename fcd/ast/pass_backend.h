@@ -26,32 +26,44 @@
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/Timer.h>
 
 #include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
-class PreAstContext;
+class FunctionCache;
 
 // XXX Make this a legit LLVM backend?
 // Doesn't sound like a bad idea, but I don't really know where to start.
 class AstBackEnd final : public llvm::ModulePass
 {
-	std::unique_ptr<PreAstContext> blockGraph;
+	class TaskScheduler;
+	
 	std::deque<std::unique_ptr<FunctionNode>> outputNodes;
 	std::deque<std::unique_ptr<AstModulePass>> passes;
-	FunctionNode* output;
+	unsigned jobCount;
+	FunctionCache* cache;
+	std::map<uint64_t, std::string> cachedOutputs;
+	std::unique_ptr<TaskScheduler> scheduler;
 	
-	inline DumbAllocator& pool() { return output->getPool(); }
+	// Only set when llvm::TimePassesIsEnabled is set. The timers and their "ast" group live until llvm_shutdown, so
+	// that their times are still there when the --time-phases report is printed.
+	std::vector<llvm::Timer*> timers;
 	
-	void runOnFunction(llvm::Function& fn);
+	void createTimers();
+	void runOnFunctions(llvm::ArrayRef<llvm::Function*> functions);
 	
 public:
 	static char ID;
 	
-	AstBackEnd();
+	// jobCount is the number of worker threads used to structurize functions and run consecutive AstFunctionPasses.
+	// 1 does everything on the calling thread; 0 uses one worker per hardware thread.
+	AstBackEnd(unsigned jobCount = 1);
 	~AstBackEnd();
 	
 	inline virtual llvm::StringRef getPassName() const override
@@ -63,8 +75,19 @@ public:
 	virtual bool runOnModule(llvm::Module& m) override;
 	
 	void addPass(AstModulePass* pass);
+	
+	// Lifted functions that have a cache key (see md::getCacheKey) and are found in the cache skip structurization and
+	// AST passes, and the ones that aren't are added to it. The cache isn't owned by the back-end.
+	void setFunctionCache(FunctionCache* functionCache) { cache = functionCache; }
+	
+	// Identifies the AST passes for cache keys.
+	std::string getPipelineIdentity() const;
+	
+	// Output for functions that were found in the cache before they were lifted, by address. These functions are only
+	// declared in the module.
+	void setCachedOutputs(std::map<uint64_t, std::string> outputs) { cachedOutputs = std::move(outputs); }
 };
 
-AstBackEnd* createAstBackEnd();
+AstBackEnd* createAstBackEnd(unsigned jobCount = 1);
 
 #endif /* fcd__ast_pass_backend_h */
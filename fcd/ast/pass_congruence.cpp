@@ -11,11 +11,11 @@
 #include "ast_passes.h"
 #include "visitor.h"
 
+#include <llvm/ADT/BitVector.h>
 #include <llvm/ADT/SmallVector.h>
 
-#include <set>
+#include <algorithm>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 using namespace llvm;
@@ -23,15 +23,6 @@ using namespace std;
 
 namespace
 {
-	struct HashSymmetricPair : private hash<Expression*>
-	{
-		size_t operator()(const pair<Expression*, Expression*>& that) const
-		{
-			const auto& hashBase = *static_cast<const hash<Expression*>*>(this);
-			return hashBase(that.first) ^ hashBase(that.second);
-		}
-	};
-	
 	bool isExpressionAddressable(NOT_NULL(Expression) expr)
 	{
 		if (auto assignable = dyn_cast<AssignableExpression>(expr))
@@ -126,7 +117,7 @@ void AstMergeCongruentVariables::doRun(FunctionNode &fn)
 		// Even if the expression has multiple uses, we can count on them being collapsed into a temporary before the
 		// first use, so we only need to consider whether memory operations happen between the definition and the first
 		// use.
-		auto iter = memoryOperations.upper_bound(memoryOperationStatement);
+		auto iter = upper_bound(memoryOperations.begin(), memoryOperations.end(), memoryOperationStatement);
 		if (iter == memoryOperations.end() || *iter >= firstUseLocation)
 		{
 			assert(cast<ExpressionStatement>(declaration)->getExpression() == expr);
@@ -141,11 +132,13 @@ void AstMergeCongruentVariables::doRun(FunctionNode &fn)
 		}
 	}
 	
-	unordered_set<pair<Expression*, Expression*>, HashSymmetricPair> candidateSet;
-	auto assignableExpressions = liveness.getAssignedExpressions();
-	for (Expression* key : assignableExpressions)
+	// Assignments between two assignables are coalescing candidates. They are visited in the order that the liveness
+	// analysis numbered assignables, so that the output doesn't depend on pointer values.
+	const auto& assignedExpressions = liveness.getAssignedExpressions();
+	vector<pair<unsigned, unsigned>> candidates;
+	for (unsigned key = 0; key < assignedExpressions.size(); ++key)
 	{
-		for (const AssignableUseDef& useDef : liveness.getUsesDefs(*key))
+		for (const AssignableUseDef& useDef : liveness.getUsesDefs(*assignedExpressions[key]))
 		{
 			if (useDef.isUse())
 			{
@@ -156,42 +149,83 @@ void AstMergeCongruentVariables::doRun(FunctionNode &fn)
 			assert(cast<NAryOperatorExpression>(user)->getType() == NAryOperatorExpression::Assign);
 			for (Expression* assignmentOperand : user->operands())
 			{
-				if (assignmentOperand != key && find(assignableExpressions, assignmentOperand) != assignableExpressions.end())
+				if (assignmentOperand != assignedExpressions[key] && liveness.isAssigned(assignmentOperand))
 				{
-					candidateSet.emplace(key, assignmentOperand);
+					unsigned operand = liveness.getAssignableIndex(assignmentOperand);
+					candidates.emplace_back(min(key, operand), max(key, operand));
 				}
 			}
 		}
 	}
+	sort(candidates.begin(), candidates.end());
+	candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
 	
-	// Only merge after we're officially done touching the liveness analysis object, since it holds a ton of references.
-	deque<pair<ExpressionReference, ExpressionReference>> mergeList;
-	for (auto& candidate : candidateSet)
+	// Coalesce candidates the way that a register allocator coalesces copies. Assignables are partitioned in classes
+	// that will be merged into the same variable, each with one leader that the other members are replaced with. Two
+	// classes can be merged when no member of one interferes with a member of the other, and the merged class inherits
+	// the interferences of both. At most one member of a class is addressable, and when there is one, it's the leader.
+	unsigned assignableCount = static_cast<unsigned>(assignedExpressions.size());
+	vector<BitVector> interferences = liveness.getInterferenceGraph();
+	vector<BitVector> members;
+	vector<unsigned> leaders;
+	vector<bool> addressable;
+	for (unsigned i = 0; i < assignableCount; ++i)
 	{
-		if (liveness.congruent(candidate.first, candidate.second))
+		members.emplace_back(assignableCount);
+		members.back().set(i);
+		leaders.push_back(i);
+		addressable.push_back(isExpressionAddressable(assignedExpressions[i]));
+	}
+	
+	auto findLeader = [&](unsigned index)
+	{
+		while (leaders[index] != index)
 		{
-			if (!isExpressionAddressable(candidate.first))
-			{
-				mergeList.emplace_back(candidate.first, candidate.second);
-			}
-			else if (!isExpressionAddressable(candidate.second))
+			leaders[index] = leaders[leaders[index]];
+			index = leaders[index];
+		}
+		return index;
+	};
+	
+	for (const auto& candidate : candidates)
+	{
+		unsigned first = findLeader(candidate.first);
+		unsigned second = findLeader(candidate.second);
+		if (first == second || interferences[first].anyCommon(members[second]))
+		{
+			continue;
+		}
+		
+		unsigned replaced = first;
+		unsigned kept = second;
+		if (addressable[first])
+		{
+			if (addressable[second])
 			{
-				mergeList.emplace_back(candidate.second, candidate.first);
+				continue;
 			}
+			swap(replaced, kept);
 		}
+		
+		leaders[replaced] = kept;
+		interferences[kept] |= interferences[replaced];
+		members[kept] |= members[replaced];
 	}
 	
-	for (auto& merge : mergeList)
+	// Only merge after we're officially done touching the liveness analysis object, since it holds a ton of references.
+	vector<pair<Expression*, Expression*>> mergeList;
+	for (unsigned i = 0; i < assignableCount; ++i)
 	{
-		// Since CongruenceCandidate contains ExpressionReferences, pointers in the list are replaced by the
-		// replaceAllUsesWith-equivalent code of mergeVariables. This means that we can end up with a candidate whose
-		// left and right are already the same variables.
-		if (merge.first.get() == merge.second.get())
+		unsigned leader = findLeader(i);
+		if (leader != i)
 		{
-			continue;
+			mergeList.emplace_back(assignedExpressions[i], assignedExpressions[leader]);
 		}
-		
-		mergeVariables(context(), merge.first.get(), merge.second.get());
+	}
+	
+	for (auto& merge : mergeList)
+	{
+		mergeVariables(fn.getContext(), merge.first, merge.second);
 	}
 }
 
@@ -14,19 +14,23 @@ using namespace std;
 
 void AstPrint::doRun(deque<std::unique_ptr<FunctionNode>> &functions)
 {
-	for (const auto& file : includes)
+	if (!printedIncludes)
 	{
-		output << "#include \"" << file << "\"\n";
-	}
-	
-	if (includes.size() > 0)
-	{
-		output << '\n';
+		for (const auto& file : includes)
+		{
+			output << "#include \"" << file << "\"\n";
+		}
+		
+		if (includes.size() > 0)
+		{
+			output << '\n';
+		}
+		printedIncludes = true;
 	}
 	
 	for (unique_ptr<FunctionNode>& fn : functions)
 	{
-		if (!fn->getBody().empty())
+		if (fn->hasBody() || fn->hasCachedOutput())
 		{
 			fn->print(output);
 		}
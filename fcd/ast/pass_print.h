@@ -21,17 +21,19 @@ class AstPrint final : public AstModulePass
 {
 	llvm::raw_ostream& output;
 	std::vector<std::string> includes;
+	bool printedIncludes;
 	
 protected:
 	virtual void doRun(std::deque<std::unique_ptr<FunctionNode>>& functions) override;
 	
 public:
 	AstPrint(llvm::raw_ostream& output, std::vector<std::string> includes)
-	: output(output), includes(std::move(includes))
+	: output(output), includes(std::move(includes)), printedIncludes(false)
 	{
 	}
 	
 	virtual const char* getName() const override;
+	virtual bool canRunOnSlices() const override { return true; }
 };
 
 #endif /* fcd__ast_pass_print_h */
@@ -345,9 +345,6 @@ void CallingConvention_AnyArch_AnyCC::getAnalysisUsage(llvm::AnalysisUsage &au)
 	
 	au.addRequired<DominatorTreeWrapperPass>();
 	au.addPreserved<DominatorTreeWrapperPass>();
-	
-	au.addRequired<PostDominatorTreeWrapperPass>();
-	au.addPreserved<PostDominatorTreeWrapperPass>();
 }
 
 bool CallingConvention_AnyArch_AnyCC::analyzeFunction(ParameterRegistry &registry, CallInformation &fillOut, llvm::Function &func)
@@ -379,8 +376,8 @@ bool CallingConvention_AnyArch_AnyCC::analyzeFunction(ParameterRegistry &registr
 		addAllUsers(*iter->second, iter->first, gepUsers);
 	}
 	
-	DominatorTree& preDom = registry.getAnalysis<DominatorTreeWrapperPass>(func).getDomTree();
-	PostDominatorTree& postDom = registry.getAnalysis<PostDominatorTreeWrapperPass>(func).getPostDomTree();
+	DominatorTree& preDom = registry.getDominatorTree(func);
+	PostDominatorTree& postDom = registry.getPostDominatorTree(func);
 	
 	// Add calls
 	SmallVector<CallInst*, 8> calls;
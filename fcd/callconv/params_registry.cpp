@@ -16,15 +16,29 @@
 #include "params_registry.h"
 #include "pass_executable.h"
 
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/BasicAliasAnalysis.h>
+#include <llvm/Analysis/CallGraph.h>
 #include <llvm/Analysis/PostDominators.h>
 #include <llvm/Analysis/TargetLibraryInfo.h>
 #include <llvm/IR/Dominators.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/TypeFinder.h>
 #include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Support/ThreadPool.h>
 
 using namespace llvm;
 using namespace std;
 
+#define DEBUG_TYPE "paramreg"
+
+STATISTIC(NumAnalysesCreated, "Number of functions whose MemorySSA and dominator tree were built");
+STATISTIC(NumAnalysesReused, "Number of times that cached MemorySSA and dominator tree analyses were reused");
+STATISTIC(NumAnalysesEvicted, "Number of MemorySSA and dominator tree analyses evicted to stay under budget");
+STATISTIC(NumParallelSCCs, "Number of call graph SCCs whose parameters were recovered on worker threads");
+
 namespace
 {
 	class CallingConventionParser : public cl::generic_parser_base
@@ -63,7 +77,7 @@ namespace
 			}
 			return callingConventions;
 		}
-		
+	
 	public:
 		typedef CallingConvention* parser_data_type;
 		
@@ -109,6 +123,7 @@ namespace
 	};
 	
 	cl::opt<CallingConvention*, false, CallingConventionParser> defaultCC("cc", cl::desc("Default calling convention"), cl::value_desc("name"), whitelist());
+	cl::opt<unsigned> analysisCacheBudget("paramreg-cache-size", cl::desc("Number of IR instructions for which parameter recovery keeps MemorySSA and dominator trees around (0 for no limit)"), cl::value_desc("instructions"), cl::init(1000000), whitelist());
 	
 	template<unsigned N>
 	bool findReg(const TargetRegisterInfo& reg, const SmallVector<ValueInformation, N>& from)
@@ -161,25 +176,86 @@ ModRefInfo CallInformation::getRegisterModRef(const TargetRegisterInfo &reg) con
 	return static_cast<ModRefInfo>(result);
 }
 
+void CallInformation::print(raw_ostream& os) const
+{
+	os << (cc == nullptr ? "unknown" : cc->getName()) << ':';
+	auto printValue = [&](const ValueInformation& value)
+	{
+		if (value.type == ValueInformation::Stack)
+		{
+			os << " sp+" << value.frameBaseOffset;
+		}
+		else
+		{
+			os << ' ' << value.registerInfo->name;
+		}
+	};
+	
+	for (const ValueInformation& value : parameters())
+	{
+		printValue(value);
+	}
+	if (isVararg())
+	{
+		os << " ...";
+	}
+	os << " ->";
+	for (const ValueInformation& value : returns())
+	{
+		printValue(value);
+	}
+}
+
+CallInformation& ParameterRegistryAAResults::getOrCreateCallInformation(const Function& fn)
+{
+	lock_guard<mutex> lock(callInformationMutex);
+	return callInformation[&fn];
+}
+
+CallInformation* ParameterRegistryAAResults::findCallInformation(const Function& fn)
+{
+	lock_guard<mutex> lock(callInformationMutex);
+	auto iter = callInformation.find(&fn);
+	return iter == callInformation.end() ? nullptr : &iter->second;
+}
+
 ModRefInfo ParameterRegistryAAResults::getModRefInfo(ImmutableCallSite cs, const MemoryLocation &loc)
 {
 	if (auto func = cs.getCalledFunction())
 	{
-		auto iter = callInformation.find(func);
-		if (iter != callInformation.end())
+		if (CallInformation* callInfo = findCallInformation(*func))
 		if (const TargetRegisterInfo* info = targetInfo->registerInfo(*loc.Ptr))
 		{
-			return iter->second.getRegisterModRef(*info);
+			return callInfo->getRegisterModRef(*info);
 		}
 	}
 	
 	return AAResultBase::getModRefInfo(cs, loc);
 }
 
+// What the on-the-fly AAResultsWrapperPass used to give for a function: basic alias analysis, and the program memory
+// alias analysis that it didn't know about. Each function gets its own, since BasicAA keeps a cache of queries.
+struct ParameterRegistry::AliasAnalysisChain
+{
+	AssumptionCache assumptionCache;
+	BasicAAResult basicAA;
+	ProgramMemoryAAResult programMemoryAA;
+	AAResults results;
+	
+	AliasAnalysisChain(Function& function, const TargetLibraryInfo& libraryInfo, DominatorTree& domTree)
+	: assumptionCache(function)
+	, basicAA(function.getParent()->getDataLayout(), libraryInfo, assumptionCache, &domTree)
+	, results(libraryInfo)
+	{
+		results.addAAResult(basicAA);
+		results.addAAResult(programMemoryAA);
+	}
+};
+
 char ParameterRegistry::ID = 0;
 
-ParameterRegistry::ParameterRegistry()
-: ModulePass(ID)
+ParameterRegistry::ParameterRegistry(unsigned jobCount)
+: ModulePass(ID), libraryInfo(nullptr), jobCount(jobCount), analysesSize(0)
 {
 }
 
@@ -189,14 +265,21 @@ ParameterRegistry::~ParameterRegistry()
 
 CallInformation* ParameterRegistry::analyzeFunction(Function& fn)
 {
-	CallInformation& info = aaResults->callInformation[&fn];
+	CallInformation& info = aaResults->getOrCreateCallInformation(fn);
 	if (info.getStage() == CallInformation::New)
 	{
+		pinAnalyses(fn);
 		for (CallingConvention* cc : ccChain)
 		{
 			PrettyStackTraceFormat analyzingFunction("Analyzing function \"%s\" with calling convention \"%s\"",
 				string(fn.getName()).c_str(), cc->getName());
 			
+			unique_lock<mutex> interactiveLock(interactiveMutex, defer_lock);
+			if (cc->getName() == CallingConvention_AnyArch_Interactive::name)
+			{
+				interactiveLock.lock();
+			}
+			
 			info.setStage(CallInformation::Analyzing);
 			if (cc->analyzeFunction(*this, info, fn))
 			{
@@ -215,6 +298,7 @@ CallInformation* ParameterRegistry::analyzeFunction(Function& fn)
 		{
 			info.setStage(CallInformation::Failed);
 		}
+		unpinAnalyses(fn);
 	}
 	
 	return info.getStage() == CallInformation::Completed ? &info : nullptr;
@@ -259,20 +343,20 @@ Executable* ParameterRegistry::getExecutable()
 const CallInformation* ParameterRegistry::getCallInfo(Function &function)
 {
 	assert(!md::isPrototype(function));
-	auto iter = aaResults->callInformation.find(&function);
-	if (iter == aaResults->callInformation.end())
+	CallInformation* info = aaResults->findCallInformation(function);
+	if (info == nullptr)
 	{
 		return analyzing ? analyzeFunction(function) : nullptr;
 	}
 	
-	return &iter->second;
+	return info;
 }
 
 const CallInformation* ParameterRegistry::getDefinitionCallInfo(Function& function)
 {
 	assert(md::isPrototype(function));
 	
-	CallInformation& info = aaResults->callInformation[&function];
+	CallInformation& info = aaResults->getOrCreateCallInformation(function);
 	if (info.getStage() == CallInformation::New)
 	{
 		for (CallingConvention* cc : *this)
@@ -335,38 +419,141 @@ unique_ptr<CallInformation> ParameterRegistry::analyzeCallSite(CallSite callSite
 	return info;
 }
 
-unique_ptr<MemorySSA> ParameterRegistry::createMemorySSA(Function &function)
+ParameterRegistry::FunctionAnalyses& ParameterRegistry::getAnalyses(Function& function)
 {
-	auto& domTree = getAnalysis<DominatorTreeWrapperPass>(function).getDomTree();
-	auto& aaResult = getAnalysis<AAResultsWrapperPass>(function).getAAResults();
+	unsigned version = md::getFunctionVersion(function);
+	unique_lock<mutex> lock(analysesMutex);
+	auto iter = analyses.find(&function);
+	if (iter != analyses.end())
+	{
+		FunctionAnalyses& cached = iter->second;
+		analysesBuilt.wait(lock, [&] { return !cached.building; });
+		recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, cached.recentUse);
+		if (cached.version == version)
+		{
+			++NumAnalysesReused;
+			return cached;
+		}
+		
+		analysesSize -= cached.size;
+		cached.mssa.reset();
+		cached.postDomTree.reset();
+		cached.aliasAnalysis.reset();
+		cached.domTree.reset();
+	}
+	else
+	{
+		recentlyUsed.push_front(&function);
+		iter = analyses.insert({&function, FunctionAnalyses()}).first;
+		iter->second.recentUse = recentlyUsed.begin();
+	}
+	
+	// Build the analyses without holding the lock, so that workers don't wait on each other. The entry can't be
+	// evicted in the meantime.
+	FunctionAnalyses& result = iter->second;
+	result.version = version;
+	result.size = 0;
+	result.building = true;
+	lock.unlock();
+	
+	size_t size = 0;
+	for (BasicBlock& block : function)
+	{
+		size += block.size();
+	}
+	
+	// The analyses of the on-the-fly pass manager are recomputed for the next function that is asked for, and can't be
+	// used from several threads, so keep our own.
+	unique_ptr<DominatorTree> domTree(new DominatorTree(function));
+	unique_ptr<AliasAnalysisChain> aliasAnalysis(new AliasAnalysisChain(function, *libraryInfo, *domTree));
+	unique_ptr<MemorySSA> mssa(new MemorySSA(function, &aliasAnalysis->results, domTree.get()));
 	
-	// XXX: don't explicitly depend on this other AA pass
-	// This will be easier once we move over to the new pass infrastructure
-	aaResult.addAAResult(*aaHack);
+	lock.lock();
+	result.size = size;
+	result.domTree = move(domTree);
+	result.aliasAnalysis = move(aliasAnalysis);
+	result.mssa = move(mssa);
+	result.building = false;
+	analysesSize += size;
+	++NumAnalysesCreated;
+	analysesBuilt.notify_all();
 	
-	return std::make_unique<MemorySSA>(function, &aaResult, &domTree);
+	evictAnalyses();
+	return result;
 }
 
-MemorySSA* ParameterRegistry::getMemorySSA(Function &function)
+void ParameterRegistry::evictAnalyses()
 {
-	unsigned version = md::getFunctionVersion(function);
-	auto iter = mssas.find(&function);
-	if (iter == mssas.end())
+	if (analysisCacheBudget == 0)
+	{
+		return;
+	}
+	
+	// The most recently used analyses were just handed out, so they always stay.
+	auto iter = recentlyUsed.end();
+	while (analysesSize > analysisCacheBudget && iter != recentlyUsed.begin())
+	{
+		--iter;
+		if (iter == recentlyUsed.begin())
+		{
+			break;
+		}
+		
+		const Function* function = *iter;
+		auto analysesIter = analyses.find(function);
+		if (functionsInUse.count(function) == 0 && !analysesIter->second.building)
+		{
+			analysesSize -= analysesIter->second.size;
+			analyses.erase(analysesIter);
+			iter = recentlyUsed.erase(iter);
+			++NumAnalysesEvicted;
+		}
+	}
+}
+
+void ParameterRegistry::pinAnalyses(const Function& fn)
+{
+	lock_guard<mutex> lock(analysesMutex);
+	++functionsInUse[&fn];
+}
+
+void ParameterRegistry::unpinAnalyses(const Function& fn)
+{
+	lock_guard<mutex> lock(analysesMutex);
+	auto iter = functionsInUse.find(&fn);
+	if (--iter->second == 0)
 	{
-		auto mssa = createMemorySSA(function);
-		iter = mssas.insert(make_pair(&function, make_pair(version, move(mssa)))).first;
+		functionsInUse.erase(iter);
 	}
-	else if (iter->second.first != version)
+}
+
+MemorySSA* ParameterRegistry::getMemorySSA(Function &function)
+{
+	return getAnalyses(function).mssa.get();
+}
+
+DominatorTree& ParameterRegistry::getDominatorTree(Function& function)
+{
+	return *getAnalyses(function).domTree;
+}
+
+PostDominatorTree& ParameterRegistry::getPostDominatorTree(Function& function)
+{
+	// Only calling conventions that look at the function that they analyze need this, and no other worker looks at
+	// that function in the meantime, so it's built on demand.
+	FunctionAnalyses& result = getAnalyses(function);
+	if (!result.postDomTree)
 	{
-		iter->second.first = version;
-		iter->second.second = createMemorySSA(function);
+		result.postDomTree.reset(new PostDominatorTree);
+		result.postDomTree->recalculate(function);
 	}
-	return iter->second.second.get();
+	return *result.postDomTree;
 }
 
 void ParameterRegistry::getAnalysisUsage(AnalysisUsage &au) const
 {
-	au.addRequired<AAResultsWrapperPass>();
+	au.addRequired<CallGraphWrapperPass>();
+	au.addPreserved<CallGraphWrapperPass>();
 	
 	au.addRequired<DominatorTreeWrapperPass>();
 	au.addPreserved<DominatorTreeWrapperPass>();
@@ -374,9 +561,6 @@ void ParameterRegistry::getAnalysisUsage(AnalysisUsage &au) const
 	au.addRequired<TargetLibraryInfoWrapperPass>();
 	au.addPreserved<TargetLibraryInfoWrapperPass>();
 	
-	au.addRequired<PostDominatorTreeWrapperPass>();
-	au.addPreserved<PostDominatorTreeWrapperPass>();
-	
 	au.addRequired<ExecutableWrapper>();
 	au.addPreserved<ExecutableWrapper>();
 	
@@ -406,14 +590,174 @@ bool ParameterRegistry::doInitialization(Module& m)
 	return ModulePass::doInitialization(m);
 }
 
+void ParameterRegistry::analyzeCallGraphInParallel(Module& m, CallGraph& callGraph)
+{
+	// Each strongly-connected component of the call graph becomes a task that can start once the tasks of every
+	// function that it calls are done. Functions of a task only ask for the call information of their callees, which
+	// is complete by then, and of the other functions of the task, which the task analyzes itself. Return value
+	// recovery also reads the MemorySSA of callers, so these are kept around until the task is done.
+	struct SCCTask
+	{
+		vector<Function*> functions;
+		vector<const Function*> callers;
+		vector<size_t> dependentTasks;
+		unsigned remainingCallees;
+	};
+	
+	vector<SCCTask> tasks;
+	unordered_map<const Function*, size_t> taskOfFunction;
+	auto addSCCs = [&](scc_iterator<CallGraphNode*> scc)
+	{
+		for (; !scc.isAtEnd(); ++scc)
+		{
+			SCCTask task;
+			for (CallGraphNode* node : *scc)
+			{
+				if (Function* fn = node->getFunction())
+				if (!md::isPrototype(*fn) && md::getAssemblyString(*fn) == nullptr && taskOfFunction.count(fn) == 0)
+				{
+					taskOfFunction[fn] = tasks.size();
+					task.functions.push_back(fn);
+				}
+			}
+			if (task.functions.size() > 0)
+			{
+				tasks.push_back(move(task));
+			}
+		}
+	};
+	
+	// Functions that the external calling node doesn't reach still get tasks, so that no worker goes through
+	// getCallInfo to analyze a function that belongs to nobody.
+	addSCCs(scc_begin(callGraph.getExternalCallingNode()));
+	for (Function& fn : m)
+	{
+		if (!md::isPrototype(fn) && md::getAssemblyString(fn) == nullptr && taskOfFunction.count(&fn) == 0)
+		{
+			addSCCs(scc_begin(callGraph[&fn]));
+		}
+	}
+	
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		SCCTask& task = tasks[i];
+		unordered_set<size_t> calleeTasks;
+		unordered_set<const Function*> callers;
+		for (Function* fn : task.functions)
+		{
+			for (const auto& record : *callGraph[fn])
+			{
+				if (Function* callee = record.second->getFunction())
+				{
+					auto iter = taskOfFunction.find(callee);
+					if (iter != taskOfFunction.end() && iter->second != i && calleeTasks.insert(iter->second).second)
+					{
+						tasks[iter->second].dependentTasks.push_back(i);
+					}
+				}
+			}
+			for (const Use& use : fn->uses())
+			{
+				if (auto call = dyn_cast<CallInst>(use.getUser()))
+				{
+					callers.insert(call->getParent()->getParent());
+				}
+			}
+		}
+		task.remainingCallees = static_cast<unsigned>(calleeTasks.size());
+		task.callers.assign(callers.begin(), callers.end());
+	}
+	
+	// Reading these for the first time changes state that the context shares, so do it before there are workers.
+	md::registerKinds(m.getContext());
+	TypeFinder structTypes;
+	structTypes.run(m, false);
+	for (StructType* type : structTypes)
+	{
+		if (type->isSized())
+		{
+			m.getDataLayout().getStructLayout(type);
+		}
+	}
+	
+	// Call information is published when a task is done: workers only look at it once the task that made it has
+	// released the lock, after scheduling the tasks that became ready.
+	ThreadPool workers(jobCount);
+	mutex schedulingMutex;
+	function<void(size_t)> runTask = [&](size_t index)
+	{
+		SCCTask& task = tasks[index];
+		for (const Function* caller : task.callers)
+		{
+			pinAnalyses(*caller);
+		}
+		for (Function* fn : task.functions)
+		{
+			analyzeFunction(*fn);
+		}
+		for (const Function* caller : task.callers)
+		{
+			unpinAnalyses(*caller);
+		}
+		++NumParallelSCCs;
+		
+		lock_guard<mutex> lock(schedulingMutex);
+		for (size_t dependent : task.dependentTasks)
+		{
+			if (--tasks[dependent].remainingCallees == 0)
+			{
+				workers.async(runTask, dependent);
+			}
+		}
+	};
+	
+	{
+		lock_guard<mutex> lock(schedulingMutex);
+		for (size_t i = 0; i < tasks.size(); ++i)
+		{
+			if (tasks[i].remainingCallees == 0)
+			{
+				workers.async(runTask, i);
+			}
+		}
+	}
+	workers.wait();
+}
+
 bool ParameterRegistry::runOnModule(Module& m)
 {
-	aaHack.reset(new ProgramMemoryAAResult);
 	setupCCChain();
 	
 	aaResults.reset(new ParameterRegistryAAResults(TargetInfo::getTargetInfo(m)));
+	libraryInfo = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
 	
 	TemporaryTrue isAnalyzing(analyzing);
+	
+	// Go bottom-up through the strongly-connected components of the call graph, so that callees are usually done by
+	// the time that their callers need them. This keeps the recursion through getCallInfo shallow, and with it the
+	// number of functions whose analyses can't be evicted. Functions that the call graph doesn't reach are picked up
+	// by the module-order loop that follows. With more than one job, components that don't call each other are
+	// analyzed at the same time.
+	CallGraph& callGraph = getAnalysis<CallGraphWrapperPass>().getCallGraph();
+	if (jobCount > 1)
+	{
+		analyzeCallGraphInParallel(m, callGraph);
+	}
+	else
+	{
+		for (auto scc = scc_begin(&callGraph); !scc.isAtEnd(); ++scc)
+		{
+			for (CallGraphNode* node : *scc)
+			{
+				if (Function* fn = node->getFunction())
+				if (!md::isPrototype(*fn) && md::getAssemblyString(*fn) == nullptr)
+				{
+					analyzeFunction(*fn);
+				}
+			}
+		}
+	}
+	
 	for (auto& fn : m.getFunctionList())
 	{
 		if (!md::isPrototype(fn) && md::getAssemblyString(fn) == nullptr)
@@ -422,12 +766,31 @@ bool ParameterRegistry::runOnModule(Module& m)
 		}
 	}
 	
+	// The function cache checks that the call information of a function and of its callees is the same as when its
+	// pseudocode was stored. This is recorded the first time that parameters are recovered, since argument recovery
+	// changes functions in a way that later runs of the registry can't see through.
+	for (auto& fn : m.getFunctionList())
+	{
+		if (md::getCacheKey(fn) != nullptr && md::getRecoveredCallInformation(fn) == nullptr)
+		{
+			string callInfoString = "failed";
+			CallInformation* info = aaResults->findCallInformation(fn);
+			if (info != nullptr && info->getStage() == CallInformation::Completed)
+			{
+				callInfoString.clear();
+				raw_string_ostream callInfoStream(callInfoString);
+				info->print(callInfoStream);
+				callInfoStream.flush();
+			}
+			md::setRecoveredCallInformation(fn, callInfoString);
+		}
+	}
+	
 	return false;
 }
 
 INITIALIZE_PASS_BEGIN(ParameterRegistry, "paramreg", "ModRef info for registers", false, true)
-INITIALIZE_PASS_DEPENDENCY(AAResultsWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(CallGraphWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
-INITIALIZE_PASS_DEPENDENCY(PostDominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfoWrapperPass)
 INITIALIZE_PASS_END(ParameterRegistry, "paramreg", "ModRef info for registers", false, true)
@@ -16,15 +16,24 @@
 #include <llvm/ADT/iterator_range.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/Analysis/PostDominators.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Utils/MemorySSA.h>
 
 #include <cassert>
+#include <condition_variable>
 #include <deque>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 class CallingConvention;
 class Executable;
@@ -100,6 +109,9 @@ public:
 	
 	llvm::ModRefInfo getRegisterModRef(const TargetRegisterInfo& reg) const;
 	
+	// Prints the calling convention, parameters and return values on a single line, like "x86_64/sysv: rdi rsi -> rax".
+	void print(llvm::raw_ostream& os) const;
+	
 	Stage getStage() const { return stage; }
 	bool isVararg() const { return vararg; }
 	CallingConvention* getCallingConvention() { return cc; }
@@ -188,18 +200,21 @@ class ParameterRegistryAAResults : public llvm::AAResultBase<ParameterRegistryAA
 	friend class llvm::AAResultBase<ParameterRegistryAAResults>;
 	friend class ParameterRegistry;
 	
+	// Several workers of the parameter registry add entries at once, so the map is only accessed with the mutex held.
+	// Entries don't move once they're in the map.
 	std::unordered_map<const llvm::Function*, CallInformation> callInformation;
+	std::mutex callInformationMutex;
 	std::unique_ptr<TargetInfo> targetInfo;
 	
+	CallInformation& getOrCreateCallInformation(const llvm::Function& fn);
+	CallInformation* findCallInformation(const llvm::Function& fn);
+	
 public:
 	ParameterRegistryAAResults(std::unique_ptr<TargetInfo> targetInfo)
 	: targetInfo(move(targetInfo))
 	{
 	}
 	
-	ParameterRegistryAAResults(const ParameterRegistryAAResults&) = default;
-	ParameterRegistryAAResults(ParameterRegistryAAResults&&) = default;
-	
 	bool invalidate(llvm::Function& fn, const llvm::PreservedAnalyses& pa)
 	{
 		// stateless
@@ -218,11 +233,38 @@ class ParameterRegistry final : public llvm::ModulePass
 {
 	std::unique_ptr<ParameterRegistryAAResults> aaResults;
 	std::unique_ptr<TargetInfo> targetInfo;
-	std::unique_ptr<ProgramMemoryAAResult> aaHack;
 	std::deque<CallingConvention*> ccChain;
-	std::unordered_map<const llvm::Function*, std::pair<unsigned, std::unique_ptr<llvm::MemorySSA>>> mssas;
+	const llvm::TargetLibraryInfo* libraryInfo;
+	unsigned jobCount;
 	bool analyzing;
 	
+	// The interactive calling convention asks questions on the standard streams and creates types in the context.
+	std::mutex interactiveMutex;
+	
+	// Analyses are kept until their function changes (see md::getFunctionVersion) or until they are the least recently
+	// used ones and the cache is over budget. The MemorySSA refers to the alias analysis and to the dominator tree, so
+	// they go together. The analyses of functions that are being analyzed, and of their callers, are in use and can't
+	// be evicted. Workers can share the analyses of a caller, so a worker that asks for analyses that another one is
+	// building waits for them.
+	struct AliasAnalysisChain;
+	struct FunctionAnalyses
+	{
+		unsigned version;
+		size_t size;
+		bool building;
+		std::unique_ptr<llvm::DominatorTree> domTree;
+		std::unique_ptr<AliasAnalysisChain> aliasAnalysis;
+		std::unique_ptr<llvm::PostDominatorTree> postDomTree;
+		std::unique_ptr<llvm::MemorySSA> mssa;
+		std::list<const llvm::Function*>::iterator recentUse;
+	};
+	std::unordered_map<const llvm::Function*, FunctionAnalyses> analyses;
+	std::list<const llvm::Function*> recentlyUsed;
+	std::unordered_map<const llvm::Function*, unsigned> functionsInUse;
+	size_t analysesSize;
+	std::mutex analysesMutex;
+	std::condition_variable analysesBuilt;
+	
 	void addCallingConvention(CallingConvention* cc)
 	{
 		assert(cc != nullptr);
@@ -230,9 +272,13 @@ class ParameterRegistry final : public llvm::ModulePass
 	}
 	
 	CallInformation* analyzeFunction(llvm::Function& fn);
+	void analyzeCallGraphInParallel(llvm::Module& m, llvm::CallGraph& callGraph);
 	void setupCCChain();
 	
-	std::unique_ptr<llvm::MemorySSA> createMemorySSA(llvm::Function& fn);
+	FunctionAnalyses& getAnalyses(llvm::Function& fn);
+	void evictAnalyses();
+	void pinAnalyses(const llvm::Function& fn);
+	void unpinAnalyses(const llvm::Function& fn);
 	
 public:
 	static char ID;
@@ -240,7 +286,7 @@ public:
 	typedef decltype(ccChain)::iterator iterator;
 	typedef decltype(ccChain)::const_iterator const_iterator;
 	
-	ParameterRegistry();
+	ParameterRegistry(unsigned jobCount = 1);
 	~ParameterRegistry();
 	
 	iterator begin() { return ccChain.begin(); }
@@ -259,6 +305,8 @@ public:
 	std::unique_ptr<CallInformation> analyzeCallSite(llvm::CallSite callSite);
 	
 	llvm::MemorySSA* getMemorySSA(llvm::Function& function);
+	llvm::DominatorTree& getDominatorTree(llvm::Function& function);
+	llvm::PostDominatorTree& getPostDominatorTree(llvm::Function& function);
 	
 	virtual void getAnalysisUsage(llvm::AnalysisUsage& au) const override;
 	virtual llvm::StringRef getPassName() const override;
@@ -266,9 +314,9 @@ public:
 	virtual bool runOnModule(llvm::Module& m) override;
 };
 
-inline ParameterRegistry* createParameterRegistryPass()
+inline ParameterRegistry* createParameterRegistryPass(unsigned jobCount = 1)
 {
-	return new ParameterRegistry;
+	return new ParameterRegistry(jobCount);
 }
 
 namespace llvm
@@ -10,11 +10,13 @@
 #include "code_generator.h"
 #include "metadata.h"
 
-#include <llvm/IRReader/IRReader.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/IR/ValueHandle.h>
 #include <llvm/Support/raw_os_ostream.h>
-#include <llvm/Support/SourceMgr.h>
 
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 using namespace llvm;
 using namespace std;
@@ -196,24 +198,31 @@ namespace
 			}
 		}
 		
-		virtual void resolveIntrinsics(llvm::Function& targetFunction, AddressToFunction& funcMap, AddressToBlock& blockMap) override
+		virtual void resolveIntrinsics(llvm::iterator_range<llvm::Function::iterator> newBlocks, AddressToFunction& funcMap, AddressToBlock& blockMap) override
 		{
-			Module& module = *targetFunction.getParent();
-			for (Function* decl : declarations)
+			// Collect calls before replacing anything, since replacing intrinsics splits and erases blocks. Weak
+			// handles are used in case that a replacement erases a call that comes after it.
+			SmallVector<WeakVH, 4> intrinsicCalls;
+			for (BasicBlock& block : newBlocks)
 			{
-				StringRef name = decl->getName();
-				Function* matching = module.getFunction(name);
-				if (isIntrinsic(name))
+				for (Instruction& inst : block)
 				{
-					auto iter = matching->use_begin();
-					while (iter != matching->use_end())
+					if (auto call = dyn_cast<CallInst>(&inst))
+					if (Function* callee = call->getCalledFunction())
+					if (isIntrinsic(callee->getName()))
 					{
-						auto call = cast<CallInst>(iter->getUser());
-						++iter;
-						replaceIntrinsic(funcMap, blockMap, name, call);
+						intrinsicCalls.emplace_back(call);
 					}
 				}
 			}
+			
+			for (Value* value : intrinsicCalls)
+			{
+				if (auto call = cast_or_null<CallInst>(value))
+				{
+					replaceIntrinsic(funcMap, blockMap, call->getCalledFunction()->getName(), call);
+				}
+			}
 		}
 		
 	public:
@@ -222,7 +231,7 @@ namespace
 		{
 		}
 		
-		virtual Constant* constantForDetail(const cs_detail& detail) override
+		virtual Constant* constantForDetail(const cs_x86& detail) override
 		{
 			LLVMContext& ctx = context();
 			Module& module = this->module();
@@ -231,7 +240,7 @@ namespace
 			Type* int32Ty = Type::getInt32Ty(ctx);
 			Type* int64Ty = Type::getInt64Ty(ctx);
 			
-			const cs_x86& cs = detail.x86;
+			const cs_x86& cs = detail;
 			StructType* x86Ty = module.getTypeByName("struct.cs_x86");
 			StructType* x86Op = module.getTypeByName("struct.cs_x86_op");
 			StructType* x86OpMem = module.getTypeByName("struct.x86_op_mem");
@@ -283,7 +292,7 @@ namespace
 		
 		virtual Function* implementationForPrologue() override
 		{
-			return getFunction("x86_function_prologue");
+			return materialize(getFunction("x86_function_prologue"));
 		}
 		
 		virtual llvm::StructType* getRegisterTy() override
@@ -317,29 +326,68 @@ bool CodeGenerator::initGenerator(const char* begin, const char* end)
 {
 	assert(end >= begin);
 	
-	SMDiagnostic errors;
+	// Only read types and declarations now. The emulator has one function per instruction, and most programs only
+	// use a small fraction of them. The buffer is embedded in the executable, so it outlives the module.
 	MemoryBufferRef buffer(StringRef(begin, static_cast<uintptr_t>(end - begin)), "IRImplementation");
-	if (auto module = parseIR(buffer, errors, ctx))
-	{
-		generatorModule = move(module);
-		return true;
-	}
-	else
+	auto moduleOrError = getLazyBitcodeModule(buffer, ctx);
+	if (!moduleOrError)
 	{
-		errors.print(nullptr, errs());
+		logAllUnhandledErrors(moduleOrError.takeError(), errs(), "couldn't load emulator module: ");
 		assert(false);
 		return false;
 	}
+	
+	generatorModule = move(moduleOrError.get());
+	return true;
+}
+
+Function* CodeGenerator::materialize(Function* fn)
+{
+	if (fn != nullptr && fn->isMaterializable())
+	{
+		if (Error error = fn->materialize())
+		{
+			logAllUnhandledErrors(move(error), errs(), "couldn't materialize " + fn->getName() + ": ");
+			return nullptr;
+		}
+	}
+	return fn;
 }
 
-unique_ptr<CodeGenerator> CodeGenerator::x86(LLVMContext &ctx)
+shared_ptr<CodeGenerator> CodeGenerator::x86(LLVMContext &ctx)
 {
-	unique_ptr<CodeGenerator> codegen(new x86CodeGenerator(ctx));
-	if (codegen->init())
+	static mutex generatorsMutex;
+	static unordered_map<LLVMContext*, weak_ptr<CodeGenerator>> generators;
+	
+	lock_guard<mutex> lock(generatorsMutex);
+	auto& generator = generators[&ctx];
+	if (auto existing = generator.lock())
+	{
+		return existing;
+	}
+	
+	// Forget about generators whose context may have gone away.
+	for (auto iter = generators.begin(); iter != generators.end();)
+	{
+		if (iter->first != &ctx && iter->second.expired())
+		{
+			iter = generators.erase(iter);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+	
+	shared_ptr<CodeGenerator> codegen(new x86CodeGenerator(ctx));
+	if (!codegen->init())
 	{
-		return codegen;
+		generators.erase(&ctx);
+		return nullptr;
 	}
-	return nullptr;
+	
+	generators[&ctx] = codegen;
+	return codegen;
 }
 
 void CodeGenerator::inlineFunction(Function *target, Function *toInline, ArrayRef<Value *> parameters, AddressToFunction& funcMap, AddressToBlock &blockMap, uint64_t nextAddress)
@@ -373,5 +421,5 @@ void CodeGenerator::inlineFunction(Function *target, Function *toInline, ArrayRe
 		ret->eraseFromParent();
 	}
 	
-	resolveIntrinsics(*target, funcMap, blockMap);
+	resolveIntrinsics(make_range(firstNewBlock, target->end()), funcMap, blockMap);
 }
@@ -39,19 +39,25 @@ protected:
 	llvm::LLVMContext& context() { return ctx; }
 	llvm::Module& module() { return *generatorModule; }
 	bool initGenerator(const char* begin, const char* end);
+	// The generator module is loaded lazily; function bodies must be materialized before they are inlined.
+	llvm::Function* materialize(llvm::Function* fn);
 	std::vector<llvm::Function*>& getFunctionMap() { return functionByOpcode; }
 	
 	virtual bool init() = 0;
 	virtual void getModuleLevelValueChanges(llvm::ValueToValueMapTy& map, llvm::Module& targetModule) = 0;
-	virtual void resolveIntrinsics(llvm::Function& targetFunction, AddressToFunction& funcMap, AddressToBlock& blockMap) = 0;
+	// Only looks at the given blocks, which are the ones that the last inlining operation created.
+	virtual void resolveIntrinsics(llvm::iterator_range<llvm::Function::iterator> newBlocks, AddressToFunction& funcMap, AddressToBlock& blockMap) = 0;
 	
 public:
 	virtual ~CodeGenerator() = default;
-	static std::unique_ptr<CodeGenerator> x86(llvm::LLVMContext& ctx);
+	
+	// There is at most one code generator per LLVMContext at any time; TranslationContexts that use the same
+	// LLVMContext share it.
+	static std::shared_ptr<CodeGenerator> x86(llvm::LLVMContext& ctx);
 	
 	llvm::Function* implementationFor(unsigned index)
 	{
-		return functionByOpcode.at(index);
+		return materialize(functionByOpcode.at(index));
 	}
 	
 	virtual llvm::Function* implementationForPrologue() = 0;
@@ -59,7 +65,7 @@ public:
 	virtual llvm::StructType* getFlagsTy() = 0;
 	virtual llvm::StructType* getConfigTy() = 0;
 	virtual llvm::ArrayRef<llvm::Value*> getIpOffset() = 0;
-	virtual llvm::Constant* constantForDetail(const cs_detail& detail) = 0;
+	virtual llvm::Constant* constantForDetail(const cs_x86& detail) = 0;
 	
 	void inlineFunction(llvm::Function *target, llvm::Function *toInline, llvm::ArrayRef<llvm::Value *> parameters, AddressToFunction& funcMap, AddressToBlock& blockMap, uint64_t nextAddress);
 };
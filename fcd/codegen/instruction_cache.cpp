@@ -0,0 +1,69 @@
+//
+// instruction_cache.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "instruction_cache.h"
+
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/Statistic.h>
+
+#include <cstring>
+
+using namespace llvm;
+using namespace std;
+
+#define DEBUG_TYPE "instruction-cache"
+
+STATISTIC(NumInstructionsDecoded, "Number of instructions decoded by Capstone");
+STATISTIC(NumInstructionsReused, "Number of instructions taken from the decoded instruction cache");
+
+InstructionCache::InstructionCache(const Executable& executable)
+: executable(executable)
+{
+}
+
+const InstructionCache::Instruction* InstructionCache::get(capstone& cs, cs_insn& scratch, uint64_t address)
+{
+	Shard& shard = shards[static_cast<size_t>(hash_value(address)) % shards.size()];
+	{
+		lock_guard<mutex> lock(shard.mutex);
+		auto iter = shard.entries.find(address);
+		if (iter != shard.entries.end())
+		{
+			++NumInstructionsReused;
+			return iter->second;
+		}
+	}
+	
+	// Decode without holding the lock. If another lifter decodes the same address in the meantime, the first entry
+	// stays.
+	const uint8_t* begin = executable.map(address);
+	bool decoded = begin != nullptr && cs.disassemble(&scratch, begin, executable.end(), address);
+	++NumInstructionsDecoded;
+	
+	lock_guard<mutex> lock(shard.mutex);
+	auto result = shard.entries.insert({address, nullptr});
+	if (result.second && decoded)
+	{
+		const cs_detail& detail = *scratch.detail;
+		Instruction* newEntry = shard.allocator.Allocate<Instruction>();
+		newEntry->address = scratch.address;
+		newEntry->id = scratch.id;
+		newEntry->size = scratch.size;
+		memcpy(newEntry->bytes, scratch.bytes, sizeof newEntry->bytes);
+		newEntry->regsReadCount = detail.regs_read_count;
+		newEntry->regsWriteCount = detail.regs_write_count;
+		newEntry->groupsCount = detail.groups_count;
+		memcpy(newEntry->regsRead, detail.regs_read, sizeof newEntry->regsRead);
+		memcpy(newEntry->regsWrite, detail.regs_write, sizeof newEntry->regsWrite);
+		memcpy(newEntry->groups, detail.groups, sizeof newEntry->groups);
+		newEntry->x86 = detail.x86;
+		result.first->second = newEntry;
+	}
+	return result.first->second;
+}
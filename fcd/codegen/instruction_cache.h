@@ -0,0 +1,68 @@
+//
+// instruction_cache.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__codegen_instruction_cache_h
+#define fcd__codegen_instruction_cache_h
+
+#include "capstone_wrapper.h"
+#include "executable.h"
+
+#include <llvm/Support/Allocator.h>
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+
+// Instructions decoded by Capstone, by address, for a single Capstone mode. Code that several functions share, like
+// tails that they all jump to, is decoded once no matter how many functions are lifted over it or how many lifters
+// lift them. Each lifter decodes with its own Capstone handle. Entries are never removed, so the instructions that get
+// returns stay valid for as long as the cache does. Methods can be called from several threads at once.
+class InstructionCache
+{
+public:
+	// The parts of a cs_insn that lifting uses. The text of the instruction and the details of other architectures
+	// are left out, which keeps entries at a fraction of the size of a cs_insn and its cs_detail.
+	struct Instruction
+	{
+		uint64_t address;
+		unsigned id;
+		uint16_t size;
+		decltype(cs_insn::bytes) bytes;
+		
+		uint8_t regsReadCount;
+		uint8_t regsWriteCount;
+		uint8_t groupsCount;
+		decltype(cs_detail::regs_read) regsRead;
+		decltype(cs_detail::regs_write) regsWrite;
+		decltype(cs_detail::groups) groups;
+		cs_x86 x86;
+	};
+	
+private:
+	// Addresses are spread over independently locked shards so that lifters rarely wait for each other. A null entry
+	// means that the address doesn't start a valid instruction.
+	struct Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<uint64_t, Instruction*> entries;
+		llvm::BumpPtrAllocator allocator;
+	};
+	
+	const Executable& executable;
+	std::array<Shard, 16> shards;
+
+public:
+	InstructionCache(const Executable& executable);
+	
+	// Returns nullptr if the address isn't mapped or doesn't start a valid instruction. scratch must have been
+	// allocated with cs.
+	const Instruction* get(capstone& cs, cs_insn& scratch, uint64_t address);
+};
+
+#endif /* fcd__codegen_instruction_cache_h */
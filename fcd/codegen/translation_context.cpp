@@ -13,6 +13,8 @@
 #include "translation_context.h"
 #include "x86_register_map.h"
 
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/Statistic.h>
 #include <llvm/ADT/Triple.h>
 #include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Verifier.h>
@@ -22,12 +24,18 @@
 #include <llvm/Transforms/Utils/Cloning.h>
 
 #include <array>
+#include <cstring>
 #include <unordered_set>
 #include <vector>
 
 using namespace llvm;
 using namespace std;
 
+#define DEBUG_TYPE "translation-context"
+
+STATISTIC(NumDetailVariables, "Number of instruction detail globals created");
+STATISTIC(NumDetailVariablesReused, "Number of instructions that reused an existing detail global");
+
 namespace
 {
 	cs_mode cs_size_mode(size_t address_size)
@@ -42,9 +50,8 @@ namespace
 		}
 	}
 	
-	CallInformation infoForInstruction(TargetInfo& target, const cs_insn& inst)
+	CallInformation infoForInstruction(TargetInfo& target, const InstructionCache::Instruction& inst)
 	{
-		const cs_detail& detail = *inst.detail;
 		CallInformation result;
 		
 		// setStage isn't really useful here since there won't be any recursive analysis
@@ -53,9 +60,9 @@ namespace
 		result.setStage(CallInformation::Analyzing);
 		
 		// inputs
-		for (size_t i = 0; i < detail.regs_read_count; ++i)
+		for (size_t i = 0; i < inst.regsReadCount; ++i)
 		{
-			if (auto registerInfo = target.registerInfo(detail.regs_read[i]))
+			if (auto registerInfo = target.registerInfo(inst.regsRead[i]))
 			{
 				const auto& largest = target.largestOverlappingRegister(*registerInfo);
 				result.addParameter(ValueInformation::IntegerRegister, &largest);
@@ -63,9 +70,9 @@ namespace
 		}
 		
 		// outputs
-		for (size_t i = 0; i < detail.regs_write_count; ++i)
+		for (size_t i = 0; i < inst.regsWriteCount; ++i)
 		{
-			if (auto registerInfo = target.registerInfo(detail.regs_write[i]))
+			if (auto registerInfo = target.registerInfo(inst.regsWrite[i]))
 			{
 				const auto& largest = target.largestOverlappingRegister(*registerInfo);
 				result.addReturn(ValueInformation::IntegerRegister, &largest);
@@ -76,12 +83,18 @@ namespace
 		return result;
 	}
 	
-	void createAsmCall(TargetInfo& targetInfo, const cs_insn& inst, Value* registerStruct, BasicBlock& insertInto)
+	void createAsmCall(TargetInfo& targetInfo, capstone& cs, cs_insn& scratch, const InstructionCache::Instruction& cached, Value* registerStruct, BasicBlock& insertInto)
 	{
 		Module& module = *insertInto.getParent()->getParent();
 		LLVMContext& ctx = module.getContext();
 		Type* integer = Type::getIntNTy(ctx, targetInfo.getPointerSize() * CHAR_BIT);
-		CallInformation info = infoForInstruction(targetInfo, inst);
+		CallInformation info = infoForInstruction(targetInfo, cached);
+		
+		// The cache doesn't keep the text of instructions. Decoding the same bytes again gives it back.
+		cs_insn& inst = scratch;
+		bool decoded = cs.disassemble(&inst, cached.bytes, cached.bytes + cached.size, cached.address);
+		assert(decoded && "cached instruction no longer decodes");
+		(void)decoded;
 		
 		// Temporary insertion point. Kind of a hack.
 		auto insertionPoint = new UnreachableInst(ctx, &insertInto);
@@ -161,9 +174,21 @@ namespace
 	}
 }
 
-TranslationContext::TranslationContext(LLVMContext& context, Executable& executable, const x86_config& config, const std::string& module_name)
+size_t TranslationContext::DetailHash::operator()(const cs_x86& detail) const
+{
+	auto bytes = reinterpret_cast<const uint8_t*>(&detail);
+	return hash_combine_range(bytes, bytes + sizeof detail);
+}
+
+bool TranslationContext::DetailEqual::operator()(const cs_x86& a, const cs_x86& b) const
+{
+	return memcmp(&a, &b, sizeof a) == 0;
+}
+
+TranslationContext::TranslationContext(LLVMContext& context, Executable& executable, const x86_config& config, const std::string& module_name, shared_ptr<InstructionCache> instructions)
 : context(context)
 , executable(executable)
+, instructions(instructions ? move(instructions) : make_shared<InstructionCache>(executable))
 , module(new Module(module_name, context))
 {
 	if (auto generator = CodeGenerator::x86(context))
@@ -246,7 +271,23 @@ TranslationContext::~TranslationContext()
 {
 }
 
-void TranslationContext::setFunctionName(uint64_t address, const std::string &name)
+GlobalVariable& TranslationContext::getDetailVariable(const cs_x86& detail)
+{
+	GlobalVariable*& variable = detailVariables[detail];
+	if (variable == nullptr)
+	{
+		Constant* detailAsConstant = irgen->constantForDetail(detail);
+		variable = new GlobalVariable(*module, detailAsConstant->getType(), true, GlobalValue::PrivateLinkage, detailAsConstant);
+		++NumDetailVariables;
+	}
+	else
+	{
+		++NumDetailVariablesReused;
+	}
+	return *variable;
+}
+
+void TranslationContext::setFunctionName(uint64_t address, StringRef name)
 {
 	functionMap->getCallTarget(address)->setName(name);
 }
@@ -273,13 +314,11 @@ Function* TranslationContext::createFunction(uint64_t baseAddress)
 	irgen->inlineFunction(fn, prologue, { configVariable, registers, flags }, *functionMap, blockMap, baseAddress);
 	
 	uint64_t addressToDisassemble;
-	auto end = executable.end();
-	auto inst = cs->alloc();
+	auto scratch = cs->alloc();
 	SmallVector<Value*, 4> inliningParameters = { configVariable, nullptr, registers, flags };
 	while (blockMap.getOneStub(addressToDisassemble))
 	{
-		if (auto begin = executable.map(addressToDisassemble))
-		if (cs->disassemble(inst.get(), begin, end, addressToDisassemble))
+		if (auto inst = instructions->get(*cs, *scratch, addressToDisassemble))
 		if (BasicBlock* thisBlock = blockMap.implementInstruction(inst->address)) // already implemented?
 		{
 			// store instruction pointer
@@ -291,13 +330,12 @@ Function* TranslationContext::createFunction(uint64_t baseAddress)
 			if (Function* implementation = irgen->implementationFor(inst->id))
 			{
 				// We have an implementation: inline it
-				Constant* detailAsConstant = irgen->constantForDetail(*inst->detail);
-				inliningParameters[1] = new GlobalVariable(*module, detailAsConstant->getType(), true, GlobalValue::PrivateLinkage, detailAsConstant);
+				inliningParameters[1] = &getDetailVariable(inst->x86);
 				irgen->inlineFunction(fn, implementation, inliningParameters, *functionMap, blockMap, nextInstAddress);
 			}
 			else
 			{
-				createAsmCall(*targetInfo, *inst, registers, *thisBlock);
+				createAsmCall(*targetInfo, *cs, *scratch, *inst, registers, *thisBlock);
 				BasicBlock* target = blockMap.blockToInstruction(nextInstAddress);
 				BranchInst::Create(target, thisBlock);
 			}
@@ -318,5 +356,6 @@ std::unordered_set<uint64_t> TranslationContext::getDiscoveredEntryPoints() cons
 
 unique_ptr<Module> TranslationContext::take()
 {
+	detailVariables.clear();
 	return move(module);
 }
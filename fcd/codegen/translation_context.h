@@ -13,6 +13,7 @@
 #include "capstone_wrapper.h"
 #include "code_generator.h"
 #include "executable.h"
+#include "instruction_cache.h"
 #include "targetinfo.h"
 #include "translation_maps.h"
 #include "x86_regs.h"
@@ -29,24 +30,41 @@ class CodeGenerator;
 
 class TranslationContext
 {
+	// Identical operand encodings share a single detail global. Hashing and comparing the raw bytes of cs_x86 can
+	// only produce false negatives (if the padding differs), never false positives.
+	struct DetailHash
+	{
+		size_t operator()(const cs_x86& detail) const;
+	};
+	
+	struct DetailEqual
+	{
+		bool operator()(const cs_x86& a, const cs_x86& b) const;
+	};
+	
 	llvm::LLVMContext& context;
 	Executable& executable;
 	std::unique_ptr<capstone> cs;
-	std::unique_ptr<CodeGenerator> irgen;
+	std::shared_ptr<InstructionCache> instructions;
+	std::shared_ptr<CodeGenerator> irgen;
 	std::unique_ptr<llvm::Module> module;
 	std::unique_ptr<AddressToFunction> functionMap;
 	
 	llvm::FunctionType* resultFnTy;
 	llvm::GlobalVariable* configVariable;
+	std::unordered_map<cs_x86, llvm::GlobalVariable*, DetailHash, DetailEqual> detailVariables;
 	
 	llvm::CastInst& getPointer(llvm::Value* intptr, size_t size);
+	llvm::GlobalVariable& getDetailVariable(const cs_x86& detail);
 	std::string nameOf(uint64_t address) const;
 	
 public:
-	TranslationContext(llvm::LLVMContext& context, Executable& executable, const x86_config& config, const std::string& module_name = "");
+	// instructions can be shared with other translation contexts that use the same configuration; when it's null, the
+	// context creates its own.
+	TranslationContext(llvm::LLVMContext& context, Executable& executable, const x86_config& config, const std::string& module_name = "", std::shared_ptr<InstructionCache> instructions = nullptr);
 	~TranslationContext();
 	
-	void setFunctionName(uint64_t address, const std::string& name);
+	void setFunctionName(uint64_t address, llvm::StringRef name);
 	llvm::Function* createFunction(uint64_t base_address);
 	std::unordered_set<uint64_t> getDiscoveredEntryPoints() const;
 	
@@ -0,0 +1,346 @@
+//
+// translation_pool.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "metadata.h"
+#include "translation_context.h"
+#include "translation_pool.h"
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <thread>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	// Functions that correspond to an address are renamed to this before linking, so that declarations in one module
+	// resolve to the definition that lives in another module. The final names are applied once linking is done.
+	string linkName(uint64_t address)
+	{
+		char name[] = "func_0000000000000000";
+		snprintf(name, sizeof name, "func_%" PRIx64, address);
+		return name;
+	}
+	
+	string workerUniqueName(StringRef prefix, unsigned workerIndex, unsigned& counter)
+	{
+		string name;
+		raw_string_ostream(name) << prefix << ".w" << workerIndex << '.' << counter;
+		++counter;
+		return name;
+	}
+	
+	// The linker merges structurally equivalent types, but the names of the fields of the structures that inline
+	// assembly functions return are keyed on the structure's name. This remembers them so that each function can get
+	// its own return type back after linking.
+	struct AssemblyFunctionInfo
+	{
+		string functionName;
+		string returnTypeName;
+		vector<string> fieldNames;
+	};
+	
+	void rebuildAssemblyFunction(Module& module, Function& function, const AssemblyFunctionInfo& info)
+	{
+		auto oldReturnType = cast<StructType>(function.getReturnType());
+		SmallVector<Type*, 8> elements(oldReturnType->element_begin(), oldReturnType->element_end());
+		StructType* returnType = StructType::create(module.getContext(), elements, info.returnTypeName);
+		md::setRecoveredReturnFieldNames(module, *returnType, info.fieldNames);
+		
+		FunctionType* oldType = function.getFunctionType();
+		FunctionType* type = FunctionType::get(returnType, oldType->params(), oldType->isVarArg());
+		Function* replacement = Function::Create(type, function.getLinkage(), "fcd.asm", &module);
+		md::setAssemblyString(*replacement, md::getAssemblyString(function)->getString());
+		
+		auto replacementArg = replacement->arg_begin();
+		for (Argument& arg : function.args())
+		{
+			replacementArg->takeName(&arg);
+			++replacementArg;
+		}
+		
+		while (!function.use_empty())
+		{
+			auto call = cast<CallInst>(function.user_back());
+			SmallVector<Value*, 8> args(call->arg_begin(), call->arg_end());
+			auto replacementCall = CallInst::Create(replacement, args, "", call);
+			replacementCall->takeName(call);
+			while (!call->use_empty())
+			{
+				auto extract = cast<ExtractValueInst>(call->user_back());
+				auto replacementExtract = ExtractValueInst::Create(replacementCall, extract->getIndices(), "", extract);
+				replacementExtract->takeName(extract);
+				extract->replaceAllUsesWith(replacementExtract);
+				extract->eraseFromParent();
+			}
+			call->eraseFromParent();
+		}
+		function.eraseFromParent();
+	}
+}
+
+struct TranslationPool::Worker
+{
+	LLVMContext context;
+	TranslationContext transl;
+	unordered_set<uint64_t> liftedFunctions;
+	
+	// filled by prepareForLinking
+	SmallVector<char, 0> bitcode;
+	unordered_set<uint64_t> calledFunctions;
+	vector<AssemblyFunctionInfo> assemblyFunctions;
+	
+	Worker(Executable& executable, const x86_config& config, const string& moduleName, shared_ptr<InstructionCache> instructions)
+	: transl(context, executable, config, moduleName, move(instructions))
+	{
+	}
+	
+	void prepareForLinking(unsigned workerIndex)
+	{
+		Module& module = transl.get();
+		
+		// Turn functions that this worker did not lift into declarations, and strip names that would collide with
+		// names of other workers' modules.
+		unsigned asmCounter = 0;
+		unsigned placeholderCounter = 0;
+		vector<pair<Function*, uint64_t>> addressedFunctions;
+		for (Function& fn : module)
+		{
+			if (auto address = md::getVirtualAddress(fn))
+			{
+				uint64_t virtualAddress = address->getLimitedValue();
+				addressedFunctions.emplace_back(&fn, virtualAddress);
+				if (liftedFunctions.count(virtualAddress) == 0)
+				{
+					calledFunctions.insert(virtualAddress);
+					fn.deleteBody();
+				}
+				fn.setName("");
+			}
+			else if (md::getAssemblyString(fn) != nullptr)
+			{
+				auto returnType = cast<StructType>(fn.getReturnType());
+				assemblyFunctions.emplace_back();
+				AssemblyFunctionInfo& info = assemblyFunctions.back();
+				info.functionName = workerUniqueName("fcd.asm", workerIndex, asmCounter);
+				info.returnTypeName = returnType->getName().str();
+				for (unsigned i = 0; i < returnType->getNumElements(); ++i)
+				{
+					info.fieldNames.push_back(md::getRecoveredReturnFieldName(module, *returnType, i).str());
+				}
+				md::removeRecoveredReturnFieldNames(module, *returnType);
+				fn.setName(info.functionName);
+			}
+		}
+		
+		for (auto& pair : addressedFunctions)
+		{
+			pair.first->setName(linkName(pair.second));
+		}
+		
+		auto iter = module.begin();
+		while (iter != module.end())
+		{
+			Function& fn = *iter;
+			++iter;
+			if (fn.getName().startswith("fcd.placeholder"))
+			{
+				if (fn.use_empty())
+				{
+					fn.eraseFromParent();
+				}
+				else
+				{
+					fn.setName(workerUniqueName("fcd.placeholder", workerIndex, placeholderCounter));
+				}
+			}
+		}
+		
+		raw_svector_ostream bitcodeStream(bitcode);
+		WriteBitcodeToFile(&module, bitcodeStream);
+	}
+};
+
+TranslationPool::TranslationPool(Executable& executable, const x86_config& config, const string& moduleName, unsigned workerCount)
+: executable(executable), config(config), moduleName(moduleName), instructions(make_shared<InstructionCache>(executable))
+{
+	assert(workerCount > 0);
+	
+	// Workers are created on this thread because Capstone's lazy global initialization isn't thread-safe.
+	for (unsigned i = 0; i < workerCount; ++i)
+	{
+		workers.emplace_back(new Worker(executable, config, moduleName, instructions));
+	}
+}
+
+TranslationPool::~TranslationPool()
+{
+}
+
+bool TranslationPool::createFunctions(const map<uint64_t, const SymbolInfo*>& functions)
+{
+	vector<const SymbolInfo*> queue;
+	for (const auto& pair : functions)
+	{
+		const SymbolInfo* info = pair.second;
+		if (functionNames.insert({info->virtualAddress, info->name}).second)
+		{
+			queue.push_back(info);
+		}
+	}
+	
+	atomic<size_t> next(0);
+	atomic<bool> failed(false);
+	vector<thread> threads;
+	for (auto& worker : workers)
+	{
+		Worker* thisWorker = worker.get();
+		threads.emplace_back([&, thisWorker]
+		{
+			TranslationContext& transl = thisWorker->transl;
+			for (size_t index = next++; index < queue.size() && !failed; index = next++)
+			{
+				const SymbolInfo& info = *queue[index];
+				if (info.name.size() > 0)
+				{
+					transl.setFunctionName(info.virtualAddress, info.name);
+				}
+				
+				if (transl.createFunction(info.virtualAddress) == nullptr)
+				{
+					failed = true;
+					break;
+				}
+				thisWorker->liftedFunctions.insert(info.virtualAddress);
+			}
+		});
+	}
+	
+	for (thread& workerThread : threads)
+	{
+		workerThread.join();
+	}
+	return !failed;
+}
+
+unordered_set<uint64_t> TranslationPool::getDiscoveredEntryPoints() const
+{
+	unordered_set<uint64_t> entryPoints;
+	for (const auto& worker : workers)
+	{
+		for (uint64_t entryPoint : worker->transl.getDiscoveredEntryPoints())
+		{
+			if (functionNames.count(entryPoint) == 0)
+			{
+				entryPoints.insert(entryPoint);
+			}
+		}
+	}
+	return entryPoints;
+}
+
+bool TranslationPool::linkInto(Module& module)
+{
+	PrettyStackTraceString linking("Linking modules lifted in parallel");
+	
+	vector<thread> threads;
+	for (unsigned i = 0; i < workers.size(); ++i)
+	{
+		Worker* worker = workers[i].get();
+		threads.emplace_back([=]
+		{
+			worker->prepareForLinking(i);
+		});
+	}
+	
+	for (thread& workerThread : threads)
+	{
+		workerThread.join();
+	}
+	
+	unordered_set<uint64_t> calledFunctions;
+	vector<AssemblyFunctionInfo> assemblyFunctions;
+	Linker linker(module);
+	for (auto& worker : workers)
+	{
+		calledFunctions.insert(worker->calledFunctions.begin(), worker->calledFunctions.end());
+		move(worker->assemblyFunctions.begin(), worker->assemblyFunctions.end(), back_inserter(assemblyFunctions));
+		
+		StringRef bitcode(worker->bitcode.data(), worker->bitcode.size());
+		auto workerModule = parseBitcodeFile(MemoryBufferRef(bitcode, moduleName), module.getContext());
+		
+		// The worker's context can go away as soon as its module has been copied.
+		worker.reset();
+		if (!workerModule)
+		{
+			logAllUnhandledErrors(workerModule.takeError(), errs(), "couldn't read lifted module: ");
+			return false;
+		}
+		
+		if (linker.linkInModule(move(workerModule.get())))
+		{
+			return false;
+		}
+	}
+	workers.clear();
+	
+	for (const AssemblyFunctionInfo& info : assemblyFunctions)
+	{
+		if (Function* fn = module.getFunction(info.functionName))
+		{
+			rebuildAssemblyFunction(module, *fn, info);
+		}
+	}
+	
+	// Functions that some worker called but that no worker lifted are left as declarations; give them back their
+	// prototype status.
+	for (uint64_t address : calledFunctions)
+	{
+		if (functionNames.count(address) == 0)
+		if (Function* fn = module.getFunction(linkName(address)))
+		{
+			md::setVirtualAddress(*fn, address);
+			md::setArgumentsRecoverable(*fn);
+		}
+	}
+	
+	// Restore names and put functions in address order, since the order in which workers picked up functions is not
+	// deterministic.
+	map<uint64_t, Function*> functionsByAddress;
+	for (Function& fn : module)
+	{
+		if (auto address = md::getVirtualAddress(fn))
+		{
+			functionsByAddress[address->getLimitedValue()] = &fn;
+		}
+	}
+	
+	auto& functionList = module.getFunctionList();
+	for (const auto& pair : functionsByAddress)
+	{
+		auto nameIter = functionNames.find(pair.first);
+		if (nameIter != functionNames.end() && nameIter->second.size() > 0)
+		{
+			pair.second->setName(nameIter->second);
+		}
+		functionList.splice(functionList.end(), functionList, pair.second->getIterator());
+	}
+	return true;
+}
@@ -0,0 +1,57 @@
+//
+// translation_pool.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__translation_pool_h
+#define fcd__translation_pool_h
+
+#include "entry_points.h"
+#include "executable.h"
+#include "instruction_cache.h"
+#include "x86_regs.h"
+
+#include <llvm/IR/Module.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Lifts functions on several threads. Every worker has its own LLVMContext, Capstone handle and code generator, and
+// lifts functions into its own module. Decoded instructions are shared between workers. Once every function has been
+// lifted, the worker modules are linked into a single module.
+class TranslationPool
+{
+	struct Worker;
+	
+	Executable& executable;
+	x86_config config;
+	std::string moduleName;
+	std::shared_ptr<InstructionCache> instructions;
+	std::vector<std::unique_ptr<Worker>> workers;
+	// Names belong to the entry point providers that gave the symbols.
+	std::unordered_map<uint64_t, llvm::StringRef> functionNames;
+	
+public:
+	TranslationPool(Executable& executable, const x86_config& config, const std::string& moduleName, unsigned workerCount);
+	~TranslationPool();
+	
+	// Lifts every function of the list, spread over the workers. Returns false if any function couldn't be lifted.
+	bool createFunctions(const std::map<uint64_t, const SymbolInfo*>& functions);
+	
+	// Returns addresses that lifted code calls but that no worker lifted yet.
+	std::unordered_set<uint64_t> getDiscoveredEntryPoints() const;
+	
+	// Merges the workers' modules into the given module, which must not contain any lifted function yet. Workers
+	// cannot be used afterwards.
+	bool linkInto(llvm::Module& module);
+};
+
+#endif /* fcd__translation_pool_h */
@@ -0,0 +1,401 @@
+//
+// decompilation_server.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "decompilation_server.h"
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	class FlatObjectParser
+	{
+		StringRef text;
+		size_t offset;
+		
+		void skipWhitespace()
+		{
+			while (offset < text.size() && isspace(static_cast<unsigned char>(text[offset])))
+			{
+				++offset;
+			}
+		}
+		
+		bool consume(char expected)
+		{
+			skipWhitespace();
+			if (offset < text.size() && text[offset] == expected)
+			{
+				++offset;
+				return true;
+			}
+			return false;
+		}
+		
+		bool parseCodeUnit(unsigned& codeUnit)
+		{
+			if (offset + 4 > text.size() || text.substr(offset, 4).getAsInteger(16, codeUnit))
+			{
+				return false;
+			}
+			offset += 4;
+			return true;
+		}
+		
+		static void appendUtf8(string& output, unsigned codePoint)
+		{
+			if (codePoint < 0x80)
+			{
+				output.push_back(static_cast<char>(codePoint));
+			}
+			else if (codePoint < 0x800)
+			{
+				output.push_back(static_cast<char>(0xc0 | (codePoint >> 6)));
+				output.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+			}
+			else if (codePoint < 0x10000)
+			{
+				output.push_back(static_cast<char>(0xe0 | (codePoint >> 12)));
+				output.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+				output.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+			}
+			else
+			{
+				output.push_back(static_cast<char>(0xf0 | (codePoint >> 18)));
+				output.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f)));
+				output.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+				output.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+			}
+		}
+		
+		bool parseString(string& output)
+		{
+			if (!consume('"'))
+			{
+				return false;
+			}
+			
+			while (offset < text.size())
+			{
+				char c = text[offset++];
+				if (c == '"')
+				{
+					return true;
+				}
+				else if (c != '\\')
+				{
+					output.push_back(c);
+					continue;
+				}
+				
+				if (offset == text.size())
+				{
+					return false;
+				}
+				
+				char escaped = text[offset++];
+				switch (escaped)
+				{
+					case '"':
+					case '\\':
+					case '/':
+						output.push_back(escaped);
+						break;
+					case 'b': output.push_back('\b'); break;
+					case 'f': output.push_back('\f'); break;
+					case 'n': output.push_back('\n'); break;
+					case 'r': output.push_back('\r'); break;
+					case 't': output.push_back('\t'); break;
+					case 'u':
+					{
+						unsigned codePoint;
+						if (!parseCodeUnit(codePoint))
+						{
+							return false;
+						}
+						
+						// Characters outside of the BMP are written as a surrogate pair.
+						if (codePoint >= 0xd800 && codePoint < 0xdc00)
+						{
+							unsigned lowSurrogate;
+							if (text.substr(offset, 2) != "\\u")
+							{
+								return false;
+							}
+							offset += 2;
+							if (!parseCodeUnit(lowSurrogate) || lowSurrogate < 0xdc00 || lowSurrogate >= 0xe000)
+							{
+								return false;
+							}
+							codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (lowSurrogate - 0xdc00);
+						}
+						appendUtf8(output, codePoint);
+						break;
+					}
+					default: return false;
+				}
+			}
+			return false;
+		}
+		
+		bool parseValue(string& output)
+		{
+			skipWhitespace();
+			if (offset < text.size() && text[offset] == '"')
+			{
+				return parseString(output);
+			}
+			
+			// Numbers and literals are kept as they were written.
+			size_t begin = offset;
+			while (offset < text.size() && (isalnum(static_cast<unsigned char>(text[offset])) || StringRef("+-.").find(text[offset]) != StringRef::npos))
+			{
+				++offset;
+			}
+			
+			StringRef value = text.substr(begin, offset - begin);
+			if (value.empty() || (isalpha(static_cast<unsigned char>(value[0])) && value != "true" && value != "false" && value != "null"))
+			{
+				return false;
+			}
+			output = value.str();
+			return true;
+		}
+		
+		bool atEnd()
+		{
+			skipWhitespace();
+			return offset == text.size();
+		}
+	
+	public:
+		FlatObjectParser(StringRef text)
+		: text(text), offset(0)
+		{
+		}
+		
+		bool parse(DecompilationServer::Request& request)
+		{
+			if (!consume('{'))
+			{
+				return false;
+			}
+			if (consume('}'))
+			{
+				return atEnd();
+			}
+			
+			do
+			{
+				string key;
+				string value;
+				skipWhitespace();
+				if (!parseString(key) || !consume(':') || !parseValue(value))
+				{
+					return false;
+				}
+				request[key] = move(value);
+			}
+			while (consume(','));
+			return consume('}') && atEnd();
+		}
+	};
+	
+	void writeJsonString(raw_ostream& os, StringRef str)
+	{
+		os << '"';
+		for (char c : str)
+		{
+			switch (c)
+			{
+				case '"': os << "\\\""; break;
+				case '\\': os << "\\\\"; break;
+				case '\n': os << "\\n"; break;
+				case '\r': os << "\\r"; break;
+				case '\t': os << "\\t"; break;
+				default:
+					if (static_cast<unsigned char>(c) < 0x20)
+					{
+						os << format("\\u%04x", static_cast<unsigned>(c));
+					}
+					else
+					{
+						os << c;
+					}
+					break;
+			}
+		}
+		os << '"';
+	}
+	
+	bool writeAll(int fd, StringRef data)
+	{
+		while (!data.empty())
+		{
+			ssize_t written = write(fd, data.data(), data.size());
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return false;
+			}
+			data = data.drop_front(static_cast<size_t>(written));
+		}
+		return true;
+	}
+}
+
+DecompilationServer::DecompilationServer(string socketPath, Handler handler)
+: socketPath(move(socketPath)), handler(move(handler))
+{
+}
+
+string DecompilationServer::respond(const string& line, bool& quit)
+{
+	Request request;
+	string output;
+	bool succeeded;
+	if (!FlatObjectParser(line).parse(request))
+	{
+		succeeded = false;
+		output = "malformed request; expected a JSON object with no nested objects or arrays on a single line";
+	}
+	else
+	{
+		auto commandIter = request.find("command");
+		if (commandIter != request.end() && commandIter->second == "quit")
+		{
+			quit = true;
+			succeeded = true;
+		}
+		else
+		{
+			succeeded = handler(request, output);
+		}
+	}
+	
+	string response;
+	raw_string_ostream responseStream(response);
+	responseStream << "{\"ok\": " << (succeeded ? "true" : "false") << ", \"" << (succeeded ? "output" : "error") << "\": ";
+	writeJsonString(responseStream, output);
+	responseStream << "}\n";
+	return responseStream.str();
+}
+
+bool DecompilationServer::serveConnection(int connection)
+{
+	string pending;
+	char buffer[4096];
+	while (true)
+	{
+		ssize_t count = read(connection, buffer, sizeof buffer);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (count <= 0)
+		{
+			return false;
+		}
+		
+		pending.append(buffer, static_cast<size_t>(count));
+		size_t lineEnd;
+		while ((lineEnd = pending.find('\n')) != string::npos)
+		{
+			string line = pending.substr(0, lineEnd);
+			pending.erase(0, lineEnd + 1);
+			if (StringRef(line).trim().empty())
+			{
+				continue;
+			}
+			
+			bool quit = false;
+			string response = respond(line, quit);
+			if (!writeAll(connection, response) || quit)
+			{
+				return quit;
+			}
+		}
+	}
+}
+
+bool DecompilationServer::run()
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof address);
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof address.sun_path)
+	{
+		errs() << "socket path is too long: " << socketPath << '\n';
+		return false;
+	}
+	memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+	
+	// A client that goes away while its response is written would otherwise take the server down with it.
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Replace a socket that a previous server left behind, but nothing else.
+	sys::fs::file_status status;
+	if (!sys::fs::status(socketPath, status) && status.type() == sys::fs::file_type::socket_file)
+	{
+		sys::fs::remove(socketPath);
+	}
+	
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		errs() << "couldn't create socket: " << strerror(errno) << '\n';
+		return false;
+	}
+	
+	if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof address) < 0 || listen(listener, 8) < 0)
+	{
+		errs() << "couldn't listen on " << socketPath << ": " << strerror(errno) << '\n';
+		close(listener);
+		return false;
+	}
+	
+	bool quit = false;
+	while (!quit)
+	{
+		int connection = accept(listener, nullptr, nullptr);
+		if (connection < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			errs() << "couldn't accept connection on " << socketPath << ": " << strerror(errno) << '\n';
+			break;
+		}
+		
+		quit = serveConnection(connection);
+		close(connection);
+	}
+	
+	close(listener);
+	sys::fs::remove(socketPath);
+	return quit;
+}
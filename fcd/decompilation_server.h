@@ -0,0 +1,50 @@
+//
+// decompilation_server.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__decompilation_server_h
+#define fcd__decompilation_server_h
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+// Answers requests on a Unix domain socket. Clients send one JSON object per line and get one JSON object per line
+// back, in order. Connections are served one after the other, so state kept between requests needs no locking.
+//
+//	{"command": "load", "path": "/bin/ls"}
+//	{"command": "decompile", "address": "0x401000"}
+//	{"command": "ir", "address": 4198400}
+//	{"command": "quit"}
+//
+// The server answers quit itself. Other requests go to the handler, and the response is either
+// {"ok": true, "output": "..."} or {"ok": false, "error": "..."}. Requests are flat objects: values are strings,
+// numbers (kept as they were written), booleans or null.
+class DecompilationServer
+{
+public:
+	typedef std::unordered_map<std::string, std::string> Request;
+	
+	// Returns false and sets output to an error message if the request failed.
+	typedef std::function<bool(const Request& request, std::string& output)> Handler;
+
+private:
+	std::string socketPath;
+	Handler handler;
+	
+	bool serveConnection(int connection);
+	std::string respond(const std::string& line, bool& quit);
+
+public:
+	DecompilationServer(std::string socketPath, Handler handler);
+	
+	// Returns once a client sends quit, or false right away if the socket can't be set up.
+	bool run();
+};
+
+#endif /* fcd__decompilation_server_h */
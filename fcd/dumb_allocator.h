@@ -13,6 +13,7 @@
 #include <llvm/ADT/StringRef.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
 #include <cstring>
@@ -36,6 +37,12 @@ class DumbAllocator
 	std::list<std::unique_ptr<char[]>> pool;
 	size_t offset;
 	
+	static std::atomic<size_t>& reservedBytes()
+	{
+		static std::atomic<size_t> bytes(0);
+		return bytes;
+	}
+	
 	inline char* allocateSmall(size_t size, size_t alignment)
 	{
 		auto& lastPage = pool.back();
@@ -46,6 +53,7 @@ class DumbAllocator
 		{
 			char* bytes = new char[DefaultChunkSize];
 			pool.emplace_back(bytes);
+			reservedBytes().fetch_add(DefaultChunkSize, std::memory_order_relaxed);
 			offset = DefaultChunkSize;
 			
 			endOffset = reinterpret_cast<uintptr_t>(&bytes[offset]);
@@ -73,6 +81,7 @@ class DumbAllocator
 		}
 		
 		pool.emplace_front(new char[requiredSize]);
+		reservedBytes().fetch_add(requiredSize, std::memory_order_relaxed);
 		void* bytes = pool.front().get();
 		std::align(alignment, requiredSize, bytes, size);
 		return static_cast<char*>(bytes);
@@ -86,6 +95,13 @@ public:
 	
 	DumbAllocator(const DumbAllocator&) = delete;
 	
+	// Total number of bytes that every DumbAllocator has ever reserved. This only grows; it's meant to be sampled
+	// before and after some work to see how much memory the work needed.
+	static size_t getTotalReservedBytes()
+	{
+		return reservedBytes().load(std::memory_order_relaxed);
+	}
+	
 	inline void clear()
 	{
 		pool.clear();
@@ -27,6 +27,7 @@ namespace
 		ERROR_MESSAGE(Main_NoEntryPoint, "no entry point (see --help)"),
 		ERROR_MESSAGE(Main_DecompilationError, "decompiler error"),
 		ERROR_MESSAGE(Main_HeaderParsingError, "header file parsing error"),
+		ERROR_MESSAGE(Main_ModuleLinkingError, "couldn't merge modules lifted in parallel"),
 		
 		ERROR_MESSAGE(Python_LoadError, "couldn't load Python script"),
 		ERROR_MESSAGE(Python_InvalidPassFunction, "run function should accept a single argument"),
@@ -30,6 +30,7 @@ enum class FcdError
 	Main_NoEntryPoint,
 	Main_DecompilationError,
 	Main_HeaderParsingError,
+	Main_ModuleLinkingError,
 	
 	Python_LoadError,
 	Python_InvalidPassFunction,
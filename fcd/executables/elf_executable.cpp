@@ -10,10 +10,13 @@
 #include "elf_executable.h"
 #include "executable_errors.h"
 
+#include <llvm/ADT/Twine.h>
 #include <llvm/Support/PrettyStackTrace.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstdint>
 #include <deque>
 #include <unordered_map>
@@ -114,6 +117,11 @@ namespace
 		PT_LOAD = 1,
 		PT_DYNAMIC = 2,
 	};
+	
+	enum ElfPhdrFlags
+	{
+		PF_X = 1,
+	};
 
 	enum ElfShdrType
 	{
@@ -358,6 +366,45 @@ namespace
 		uint64_t vend;
 		const uint8_t* fbegin;
 	};
+	
+	// Turns segments in program header order into a sorted list of non-overlapping segments. Where segments overlap,
+	// the one that comes last in the program header wins, like it would with a reverse linear search.
+	vector<Segment> flattenSegments(const vector<Segment>& loadOrder)
+	{
+		vector<Segment> result;
+		for (const Segment& seg : loadOrder)
+		{
+			if (seg.vbegin >= seg.vend)
+			{
+				continue;
+			}
+			
+			vector<Segment> flattened;
+			for (const Segment& existing : result)
+			{
+				if (existing.vbegin < seg.vbegin)
+				{
+					Segment before = existing;
+					before.vend = min(existing.vend, seg.vbegin);
+					flattened.push_back(before);
+				}
+				if (existing.vend > seg.vend)
+				{
+					Segment after = existing;
+					after.vbegin = max(existing.vbegin, seg.vend);
+					after.fbegin = existing.fbegin + (after.vbegin - existing.vbegin);
+					flattened.push_back(after);
+				}
+			}
+			flattened.push_back(seg);
+			sort(flattened.begin(), flattened.end(), [](const Segment& a, const Segment& b)
+			{
+				return a.vbegin < b.vbegin;
+			});
+			result = move(flattened);
+		}
+		return result;
+	}
 
 	template<typename Types>
 	class ElfExecutable final : public Executable
@@ -404,7 +451,10 @@ namespace
 			return reinterpret_cast<const Elf_Ehdr*>(begin());
 		}
 		
+		// sorted and non-overlapping, see flattenSegments
 		vector<Segment> segments;
+		mutable atomic<const Segment*> lastHit;
+		vector<ArrayRef<uint8_t>> codeRanges;
 		unordered_map<uint64_t, string> stubTargets;
 		
 	protected:
@@ -504,7 +554,7 @@ namespace
 		static ErrorOr<unique_ptr<ElfExecutable<Types>>> parse(const uint8_t* begin, const uint8_t* end);
 		
 		ElfExecutable(const uint8_t* begin, const uint8_t* end)
-		: Executable(begin, end)
+		: Executable(begin, end), lastHit(nullptr)
 		{
 			assert(end - begin >= sizeof(Elf_Ehdr));
 		}
@@ -523,14 +573,35 @@ namespace
 		
 		virtual const uint8_t* map(uint64_t address) const override
 		{
-			for (auto iter = segments.rbegin(); iter != segments.rend(); iter++)
+			// Lookups tend to be sequential, so check the segment that was last hit first.
+			const Segment* segment = lastHit.load(memory_order_relaxed);
+			if (segment == nullptr || address < segment->vbegin || address >= segment->vend)
 			{
-				if (address >= iter->vbegin && address < iter->vend)
+				auto iter = upper_bound(segments.begin(), segments.end(), address, [](uint64_t value, const Segment& seg)
+				{
+					return value < seg.vbegin;
+				});
+				
+				if (iter == segments.begin())
 				{
-					return iter->fbegin + (address - iter->vbegin);
+					return nullptr;
 				}
+				
+				--iter;
+				if (address >= iter->vend)
+				{
+					return nullptr;
+				}
+				
+				segment = &*iter;
+				lastHit.store(segment, memory_order_relaxed);
 			}
-			return nullptr;
+			return segment->fbegin + (address - segment->vbegin);
+		}
+		
+		virtual vector<ArrayRef<uint8_t>> getCodeRanges() const override
+		{
+			return codeRanges;
 		}
 		
 		virtual StubTargetQueryResult doGetStubTarget(uint64_t address, string& libraryName, string& into) const override
@@ -695,6 +766,7 @@ namespace
 		deque<const Elf_Shdr*> symtabs;
 		
 		// Walk header, identify PT_LOAD and PT_DYNAMIC segments, sections, and symbol tables.
+		vector<Segment> loadSegments;
 		bool loadAtZero = false;
 		if (auto eh = bounded_cast<Elf_Ehdr>(begin, end, 0))
 		{
@@ -714,8 +786,12 @@ namespace
 								seg.vbegin = ph.vaddr;
 								seg.vend = endAddress;
 								seg.fbegin = fileLoc.begin();
-								executable->segments.push_back(seg);
+								loadSegments.push_back(seg);
 								loadAtZero |= seg.vbegin == 0;
+								if (ph.flags & PF_X)
+								{
+									executable->codeRanges.emplace_back(fileLoc.begin(), fileLoc.end());
+								}
 							}
 						}
 					}
@@ -726,6 +802,8 @@ namespace
 				}
 			}
 			
+			executable->segments = flattenSegments(loadSegments);
+			
 			if (eh->shentsize == sizeof (Elf_Shdr))
 			{
 				for (const auto& sh : bounded_cast<Elf_Shdr>(begin, end, eh->shoff, eh->shnum))
@@ -740,7 +818,7 @@ namespace
 			
 			if (eh->entry != 0 || loadAtZero)
 			{
-				executable->getSymbol(eh->entry).virtualAddress = eh->entry;
+				executable->addSymbol(eh->entry);
 			}
 		}
 		
@@ -775,9 +853,7 @@ namespace
 				const string& prefix = arrayData.name;
 				for (addr entry : bounded_cast<addr>(begin, end, arrayLocation->address, arraySize->address))
 				{
-					auto& symInfo = executable->getSymbol(entry);
-					symInfo.virtualAddress = entry;
-					raw_string_ostream(symInfo.name) << prefix << counter;
+					executable->setSymbol(entry, (prefix + Twine(counter)).str());
 					counter++;
 				}
 			}
@@ -792,9 +868,7 @@ namespace
 			auto location = dynEnt[pair.first];
 			if (location != nullptr)
 			{
-				auto& symInfo = executable->getSymbol(location->address);
-				symInfo.virtualAddress = location->address;
-				symInfo.name = pair.second;
+				executable->setSymbol(location->address, pair.second);
 			}
 		}
 		
@@ -886,18 +960,7 @@ namespace
 					nameEnd = nameBegin + strnlen(nameBegin, maxSize);
 				}
 				
-				auto& symInfo = executable->getSymbol(sym.value);
-				symInfo.virtualAddress = sym.value;
-				symInfo.name = string(nameBegin, nameEnd);
-			}
-		}
-		
-		// Figure out file offset for symbols, remove those that don't have one.
-		for (auto entryPoint : executable->getVisibleEntryPoints())
-		{
-			if (executable->map(entryPoint) == nullptr)
-			{
-				executable->eraseSymbol(entryPoint);
+				executable->setSymbol(sym.value, StringRef(nameBegin, static_cast<size_t>(nameEnd - nameBegin)));
 			}
 		}
 		
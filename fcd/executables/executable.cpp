@@ -194,31 +194,42 @@ string Executable::getTargetTriple() const
 
 vector<uint64_t> Executable::getVisibleEntryPoints() const
 {
+	auto symbolList = symbols.getSymbols();
 	vector<uint64_t> result;
-	for (const auto& pair : symbols)
+	result.reserve(symbolList.size());
+	for (const SymbolInfo& symbol : symbolList)
 	{
-		result.push_back(pair.second.virtualAddress);
+		result.push_back(symbol.virtualAddress);
 	}
-	sort(result.begin(), result.end());
 	return result;
 }
 
 const SymbolInfo* Executable::getInfo(uint64_t address) const
 {
-	auto iter = symbols.find(address);
-	if (iter != symbols.end())
+	if (const SymbolInfo* symbol = symbols.find(address))
+	{
+		return symbol;
+	}
+	
+	auto iter = unnamedSymbols.find(address);
+	if (iter != unnamedSymbols.end())
 	{
 		return &iter->second;
 	}
 	else if (map(address) != nullptr)
 	{
-		SymbolInfo& info = symbols[address];
+		SymbolInfo& info = unnamedSymbols[address];
 		info.virtualAddress = address;
 		return &info;
 	}
 	return nullptr;
 }
 
+vector<ArrayRef<uint8_t>> Executable::getCodeRanges() const
+{
+	return {};
+}
+
 const StubInfo* Executable::getStubTarget(uint64_t address) const
 {
 	auto iter = stubTargets.find(address);
@@ -255,5 +266,19 @@ const StubInfo* Executable::getStubTarget(uint64_t address) const
 
 ErrorOr<unique_ptr<Executable>> Executable::parse(const uint8_t* begin, const uint8_t* end)
 {
-	return executableFactory->parse(begin, end);
+	auto executable = executableFactory->parse(begin, end);
+	if (executable)
+	{
+		Executable& parsed = *executable.get();
+		parsed.symbols.seal([&](uint64_t address)
+		{
+			return parsed.map(address) != nullptr;
+		});
+	}
+	return executable;
+}
+
+bool Executable::isScripted()
+{
+	return executableFactory == &pythonScriptExecutableFactory;
 }
@@ -11,7 +11,9 @@
 #define fcd__executables_executable_h
 
 #include "entry_points.h"
+#include "symbol_table.h"
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/Support/ErrorOr.h>
 
 #include <memory>
@@ -32,7 +34,9 @@ class Executable : public EntryPointProvider
 {
 	const uint8_t* dataBegin;
 	const uint8_t* dataEnd;
-	mutable std::unordered_map<uint64_t, SymbolInfo> symbols;
+	SymbolTable symbols;
+	// Addresses that have no symbol but that were asked for anyway.
+	mutable std::unordered_map<uint64_t, SymbolInfo> unnamedSymbols;
 	mutable std::unordered_map<uint64_t, StubInfo> stubTargets;
 	mutable std::set<std::string> libraries;
 	
@@ -49,8 +53,9 @@ protected:
 	{
 	}
 	
-	SymbolInfo& getSymbol(uint64_t address) { return symbols[address]; }
-	void eraseSymbol(uint64_t address) { symbols.erase(address); }
+	// Symbols that don't map to the executable are dropped once parsing is done.
+	void addSymbol(uint64_t address) { symbols.add(address); }
+	void setSymbol(uint64_t address, llvm::StringRef name) { symbols.set(address, name); }
 	
 	virtual StubTargetQueryResult doGetStubTarget(uint64_t address, std::string& sharedObject, std::string& symbolName) const = 0;
 	virtual std::string doGetTargetTriple() const = 0;
@@ -58,6 +63,10 @@ protected:
 public:
 	static llvm::ErrorOr<std::unique_ptr<Executable>> parse(const uint8_t* begin, const uint8_t* end);
 	
+	// Whether --format selects a Python script. Such executables call into the interpreter, which can only be used
+	// from one thread at a time.
+	static bool isScripted();
+	
 	virtual std::string getExecutableType() const = 0;
 	std::string getTargetTriple() const;
 	
@@ -66,6 +75,9 @@ public:
 	
 	virtual const uint8_t* map(uint64_t address) const = 0;
 	
+	// Parts of the file that hold code, according to its headers. Only used as a hint for how the file is read.
+	virtual std::vector<llvm::ArrayRef<uint8_t>> getCodeRanges() const;
+	
 	virtual std::vector<uint64_t> getVisibleEntryPoints() const override final;
 	virtual const SymbolInfo* getInfo(uint64_t address) const override final;
 	const StubInfo* getStubTarget(uint64_t address) const;
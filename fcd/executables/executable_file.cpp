@@ -0,0 +1,109 @@
+//
+// executable_file.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "executable.h"
+#include "executable_file.h"
+
+#include <llvm/Support/FileSystem.h>
+
+#include <string>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	class MappedExecutableBuffer final : public MemoryBuffer
+	{
+		sys::fs::mapped_file_region region;
+		string name;
+	
+	public:
+		MappedExecutableBuffer(int fd, uint64_t size, StringRef name, error_code& error)
+		: region(fd, sys::fs::mapped_file_region::readonly, size, 0, error), name(name.str())
+		{
+			if (!error)
+			{
+				init(region.const_data(), region.const_data() + region.size(), false);
+			}
+		}
+		
+		virtual StringRef getBufferIdentifier() const override
+		{
+			return name;
+		}
+		
+		virtual BufferKind getBufferKind() const override
+		{
+			return MemoryBuffer_MMap;
+		}
+	};
+	
+	void advise(const uint8_t* begin, const uint8_t* end, int advice)
+	{
+		// madvise wants a page-aligned address; the range is widened to the pages that it touches.
+		uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+		uintptr_t first = reinterpret_cast<uintptr_t>(begin) & ~(pageSize - 1);
+		uintptr_t last = reinterpret_cast<uintptr_t>(end);
+		if (last > first)
+		{
+			madvise(reinterpret_cast<void*>(first), last - first, advice);
+		}
+	}
+}
+
+ErrorOr<unique_ptr<MemoryBuffer>> mapExecutableFile(StringRef path)
+{
+	int fd;
+	if (auto error = sys::fs::openFileForRead(path, fd))
+	{
+		return error;
+	}
+	
+	sys::fs::file_status status;
+	if (auto error = sys::fs::status(fd, status))
+	{
+		close(fd);
+		return error;
+	}
+	
+	// Empty files can't be mapped.
+	if (status.getSize() == 0)
+	{
+		close(fd);
+		return MemoryBuffer::getMemBuffer(StringRef("", 0), path, false);
+	}
+	
+	// The mapping stays valid once the file is closed.
+	error_code error;
+	unique_ptr<MemoryBuffer> buffer(new MappedExecutableBuffer(fd, status.getSize(), path, error));
+	close(fd);
+	if (error)
+	{
+		return error;
+	}
+	return move(buffer);
+}
+
+void adviseExecutableAccess(const MemoryBuffer& buffer, const Executable& executable)
+{
+	if (buffer.getBufferKind() != MemoryBuffer::MemoryBuffer_MMap)
+	{
+		return;
+	}
+	
+	advise(executable.begin(), executable.end(), MADV_RANDOM);
+	for (ArrayRef<uint8_t> range : executable.getCodeRanges())
+	{
+		advise(range.begin(), range.end(), MADV_WILLNEED);
+	}
+}
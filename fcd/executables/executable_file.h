@@ -0,0 +1,29 @@
+//
+// executable_file.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__executables_executable_file_h
+#define fcd__executables_executable_file_h
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+
+class Executable;
+
+// Maps the file at path read-only. MemoryBuffer::getFile reads files that it considers small into the heap; executables
+// are always mapped, so that only the pages that fcd looks at are read in.
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> mapExecutableFile(llvm::StringRef path);
+
+// Lifting reads the file out of order, which makes read-ahead a waste outside of code. Code ranges are read ahead
+// of time instead. Does nothing with buffers that aren't mapped.
+void adviseExecutableAccess(const llvm::MemoryBuffer& buffer, const Executable& executable);
+
+#endif /* fcd__executables_executable_file_h */
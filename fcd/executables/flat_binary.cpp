@@ -52,6 +52,11 @@ namespace
 			return nullptr;
 		}
 		
+		virtual vector<ArrayRef<uint8_t>> getCodeRanges() const override
+		{
+			return { ArrayRef<uint8_t>(begin(), end()) };
+		}
+		
 		virtual StubTargetQueryResult doGetStubTarget(uint64_t address, string& libraryName, string& into) const override
 		{
 			return Unresolved;
@@ -53,12 +53,39 @@ namespace
 		{
 		}
 		
+		// Scripts that set zeroCopy to True get a read-only memoryview of the executable instead of a copy of it in a
+		// string. The view is valid for as long as the executable is.
+		bool wantsZeroCopy()
+		{
+			PyErrClearAtEnd clearPyErrAtEndOfFunction;
+			
+			auto zeroCopy = TAKEREF PyObject_GetAttrString(module.get(), "zeroCopy");
+			return zeroCopy && PyObject_IsTrue(zeroCopy.get()) == 1;
+		}
+		
 		bool callInitFunction()
 		{
 			PyErrClearAtEnd clearPyErrAtEndOfFunction;
 			
 			auto init = getCallable("init");
-			auto bytes = TAKEREF PyString_FromStringAndSize(reinterpret_cast<const char*>(begin()), end() - begin());
+			AutoPyObject bytes;
+			if (wantsZeroCopy())
+			{
+				Py_buffer view;
+				PyBuffer_FillInfo(&view, nullptr, const_cast<uint8_t*>(begin()), end() - begin(), 1, PyBUF_CONTIG_RO);
+				bytes = TAKEREF PyMemoryView_FromBuffer(&view);
+			}
+			else
+			{
+				bytes = TAKEREF PyString_FromStringAndSize(reinterpret_cast<const char*>(begin()), end() - begin());
+			}
+			
+			if (!bytes)
+			{
+				errs() << "Script " << path << " couldn't be given the executable!\n";
+				PyErr_Print();
+				return false;
+			}
 			callObject(init, bytes);
 			
 			if (PyErr_Occurred())
@@ -144,9 +171,7 @@ namespace
 						return false;
 					}
 					
-					auto& symbol = getSymbol(address);
-					symbol.name = move(symbolName);
-					symbol.virtualAddress = address;
+					setSymbol(address, symbolName);
 				}
 				return true;
 			}
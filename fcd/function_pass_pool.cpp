@@ -0,0 +1,298 @@
+//
+// function_pass_pool.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "function_pass_pool.h"
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/PassInfo.h>
+#include <llvm/PassRegistry.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	bool isLinkable(const GlobalValue& value)
+	{
+		return value.hasName() && !value.hasLocalLinkage();
+	}
+	
+	// The linker doesn't resolve references to local or unnamed globals, so they get a temporary external name while
+	// the module is split.
+	struct ExternalizedGlobal
+	{
+		GlobalVariable* global;
+		string name;
+		GlobalValue::LinkageTypes linkage;
+	};
+}
+
+struct FunctionPassPool::Worker
+{
+	LLVMContext context;
+	unordered_set<string> functionNames;
+	SmallVector<char, 0> bitcode;
+	bool succeeded;
+	
+	Worker()
+	: succeeded(false)
+	{
+	}
+	
+	void run(StringRef moduleBitcode, StringRef moduleName, const FunctionPassPool& pool)
+	{
+		auto moduleOrError = parseBitcodeFile(MemoryBufferRef(moduleBitcode, moduleName), context);
+		if (!moduleOrError)
+		{
+			logAllUnhandledErrors(moduleOrError.takeError(), errs(), "couldn't read module partition: ");
+			return;
+		}
+		
+		Module& module = *moduleOrError.get();
+		for (Function& fn : module)
+		{
+			if (!fn.isDeclaration() && functionNames.count(fn.getName().str()) == 0)
+			{
+				fn.deleteBody();
+			}
+		}
+		
+		vector<string> globalNames;
+		for (GlobalVariable& global : module.globals())
+		{
+			globalNames.push_back(global.getName().str());
+		}
+		
+		legacy::PassManager passManager;
+		pool.setupAnalyses(passManager);
+		for (Pass* pass : pool.createPasses())
+		{
+			passManager.add(pass);
+		}
+		passManager.run(module);
+		
+		// Globals that existed before the passes ran are references to the original module's globals. Named
+		// metadata is already in the original module and would be appended a second time.
+		for (const string& name : globalNames)
+		{
+			if (GlobalVariable* global = module.getGlobalVariable(name))
+			{
+				global->setInitializer(nullptr);
+			}
+		}
+		while (!module.named_metadata_empty())
+		{
+			module.eraseNamedMetadata(&*module.named_metadata_begin());
+		}
+		
+		raw_svector_ostream bitcodeStream(bitcode);
+		WriteBitcodeToFile(&module, bitcodeStream);
+		succeeded = true;
+	}
+};
+
+FunctionPassPool::FunctionPassPool(unsigned workerCount, AnalysisSetup setupAnalyses, PassFactory createPasses)
+: workerCount(workerCount), setupAnalyses(move(setupAnalyses)), createPasses(move(createPasses))
+{
+	assert(workerCount > 0);
+}
+
+FunctionPassPool::~FunctionPassPool()
+{
+}
+
+bool FunctionPassPool::canRunInParallel(const Pass& pass)
+{
+	if (pass.getPassKind() != PT_Function)
+	{
+		return false;
+	}
+	
+	// Passes registered under a name that starts with # can't be created from the pass pipeline (like Python passes).
+	const PassInfo* info = PassRegistry::getPassRegistry()->getPassInfo(pass.getPassID());
+	return info != nullptr && info->getNormalCtor() != nullptr && !info->getPassArgument().startswith("#");
+}
+
+bool FunctionPassPool::runOnSingleThread(Module& module) const
+{
+	legacy::PassManager passManager;
+	setupAnalyses(passManager);
+	for (Pass* pass : createPasses())
+	{
+		passManager.add(pass);
+	}
+	passManager.run(module);
+	return true;
+}
+
+bool FunctionPassPool::run(Module& module)
+{
+	PrettyStackTraceString optimizing("Running function passes in parallel");
+	
+	// Functions are matched with their optimized version by name. Lifted functions always have one, but anything
+	// else is left to a single thread.
+	vector<pair<size_t, Function*>> definitions;
+	for (Function& fn : module)
+	{
+		if (!fn.isDeclaration())
+		{
+			if (!isLinkable(fn))
+			{
+				return runOnSingleThread(module);
+			}
+			
+			size_t size = 0;
+			for (BasicBlock& block : fn)
+			{
+				size += block.size();
+			}
+			definitions.emplace_back(size, &fn);
+		}
+	}
+	
+	unsigned partitionCount = static_cast<unsigned>(min<size_t>(workerCount, definitions.size()));
+	if (partitionCount < 2)
+	{
+		return runOnSingleThread(module);
+	}
+	
+	// Hand out the largest functions first, each to the worker that has the fewest instructions so far.
+	vector<unique_ptr<Worker>> workers;
+	vector<size_t> workerSizes(partitionCount);
+	for (unsigned i = 0; i < partitionCount; ++i)
+	{
+		workers.emplace_back(new Worker);
+	}
+	
+	stable_sort(definitions.begin(), definitions.end(), [](const pair<size_t, Function*>& a, const pair<size_t, Function*>& b)
+	{
+		return a.first > b.first;
+	});
+	for (const auto& pair : definitions)
+	{
+		size_t index = static_cast<size_t>(min_element(workerSizes.begin(), workerSizes.end()) - workerSizes.begin());
+		workers[index]->functionNames.insert(pair.second->getName().str());
+		workerSizes[index] += pair.first;
+	}
+	
+	vector<ExternalizedGlobal> externalizedGlobals;
+	for (GlobalVariable& global : module.globals())
+	{
+		if (!isLinkable(global))
+		{
+			externalizedGlobals.push_back({&global, global.getName().str(), global.getLinkage()});
+			global.setLinkage(GlobalValue::ExternalLinkage);
+			global.setName("fcd.partition.global");
+		}
+	}
+	
+	SmallVector<char, 0> bitcode;
+	raw_svector_ostream bitcodeStream(bitcode);
+	WriteBitcodeToFile(&module, bitcodeStream);
+	
+	StringRef moduleBitcode(bitcode.data(), bitcode.size());
+	StringRef moduleName = module.getModuleIdentifier();
+	vector<thread> threads;
+	for (auto& worker : workers)
+	{
+		Worker* thisWorker = worker.get();
+		threads.emplace_back([=]
+		{
+			thisWorker->run(moduleBitcode, moduleName, *this);
+		});
+	}
+	
+	for (thread& workerThread : threads)
+	{
+		workerThread.join();
+	}
+	
+	// The linker puts the functions that it brings in at the end of the module. Remember the original order so that
+	// the output doesn't depend on how functions were partitioned.
+	vector<string> functionOrder;
+	for (Function& fn : module)
+	{
+		functionOrder.push_back(fn.getName().str());
+	}
+	
+	bool linked = all_of(workers.begin(), workers.end(), [](const unique_ptr<Worker>& worker)
+	{
+		return worker->succeeded;
+	});
+	
+	Linker linker(module);
+	for (auto& worker : workers)
+	{
+		if (!linked)
+		{
+			break;
+		}
+		
+		// A declaration is replaced by the definition that is linked in, while a definition would be kept.
+		for (const string& name : worker->functionNames)
+		{
+			module.getFunction(name)->deleteBody();
+		}
+		
+		StringRef workerBitcode(worker->bitcode.data(), worker->bitcode.size());
+		auto workerModule = parseBitcodeFile(MemoryBufferRef(workerBitcode, moduleName), module.getContext());
+		
+		// The worker's context can go away as soon as its module has been copied.
+		worker.reset();
+		if (!workerModule)
+		{
+			logAllUnhandledErrors(workerModule.takeError(), errs(), "couldn't read optimized module partition: ");
+			linked = false;
+		}
+		else if (linker.linkInModule(move(workerModule.get())))
+		{
+			linked = false;
+		}
+	}
+	
+	for (const ExternalizedGlobal& externalized : externalizedGlobals)
+	{
+		externalized.global->setLinkage(externalized.linkage);
+		externalized.global->setName(externalized.name);
+	}
+	
+	auto& functionList = module.getFunctionList();
+	vector<Function*> addedFunctions;
+	unordered_set<string> originalNames(functionOrder.begin(), functionOrder.end());
+	for (Function& fn : module)
+	{
+		if (originalNames.count(fn.getName().str()) == 0)
+		{
+			addedFunctions.push_back(&fn);
+		}
+	}
+	for (const string& name : functionOrder)
+	{
+		if (Function* fn = module.getFunction(name))
+		{
+			functionList.splice(functionList.end(), functionList, fn->getIterator());
+		}
+	}
+	for (Function* fn : addedFunctions)
+	{
+		functionList.splice(functionList.end(), functionList, fn->getIterator());
+	}
+	return linked;
+}
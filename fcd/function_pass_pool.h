@@ -0,0 +1,55 @@
+//
+// function_pass_pool.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__function_pass_pool_h
+#define fcd__function_pass_pool_h
+
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+
+#include <functional>
+#include <vector>
+
+// Runs a sequence of function passes on several threads. The module is written to bitcode, and every worker reads it
+// back in its own LLVMContext, keeps the bodies of its share of the functions and runs the passes over them. The
+// optimized functions are then linked back in place of the original ones. Function passes only change the function
+// that they run on, so this gives the same module as running the passes on a single thread, at the cost of one copy
+// of the module per worker.
+class FunctionPassPool
+{
+public:
+	// Adds the analyses that the passes expect to find to a worker's pass manager.
+	typedef std::function<void(llvm::legacy::PassManager&)> AnalysisSetup;
+	
+	// Creates a worker's instances of the passes. Called from the worker's thread.
+	typedef std::function<std::vector<llvm::Pass*>()> PassFactory;
+
+private:
+	struct Worker;
+	
+	unsigned workerCount;
+	AnalysisSetup setupAnalyses;
+	PassFactory createPasses;
+	
+	bool runOnSingleThread(llvm::Module& module) const;
+
+public:
+	FunctionPassPool(unsigned workerCount, AnalysisSetup setupAnalyses, PassFactory createPasses);
+	~FunctionPassPool();
+	
+	// Workers need their own instances of passes, so only function passes that can be created again from the pass
+	// registry can run in parallel.
+	static bool canRunInParallel(const llvm::Pass& pass);
+	
+	// Returns false if the workers' modules couldn't be linked back, in which case the module is left incomplete.
+	bool run(llvm::Module& module);
+};
+
+#endif /* fcd__function_pass_pool_h */
@@ -23,6 +23,8 @@
 #include <clang/Index/CodegenNameGenerator.h>
 #include <llvm/IR/CallingConv.h>
 #include <llvm/IR/Function.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/PrettyStackTrace.h>
 
@@ -94,15 +96,234 @@ namespace
 		return info.dli_fname;
 	}
 	
+	const char cacheIndexMagic[] = "fcd-header-cache-3";
+	
+	string getDigest(StringRef data)
+	{
+		MD5 hash;
+		hash.update(data);
+		MD5::MD5Result result;
+		hash.final(result);
+		SmallString<32> digest;
+		MD5::stringifyResult(result, digest);
+		return digest.str();
+	}
+	
+	// The cache key covers everything that goes into parsing the headers, except for the contents of the files that
+	// end up being included; those are listed in the cache index and checked separately.
+	string getCacheKey(const vector<string>& invocationArgs, const vector<string>& searchPath, StringRef includeContent, StringRef triple)
+	{
+		string key;
+		raw_string_ostream keyStream(key);
+		keyStream << cacheIndexMagic << '\0' << CLANG_VERSION_STRING << '\0' << triple << '\0';
+		
+		// "." is a search path.
+		SmallString<128> workingDirectory;
+		if (!sys::fs::current_path(workingDirectory))
+		{
+			keyStream << workingDirectory << '\0';
+		}
+		
+		for (const auto& arg : invocationArgs)
+		{
+			keyStream << arg << '\0';
+		}
+		for (const auto& includeDir : searchPath)
+		{
+			keyStream << includeDir << '\0';
+		}
+		for (const char** includePathIter = defaultHeaderSearchPathList; *includePathIter != nullptr; ++includePathIter)
+		{
+			keyStream << *includePathIter << '\0';
+		}
+		keyStream << includeContent;
+		return getDigest(keyStream.str());
+	}
+	
+	// Lists the files that a cached AST depends on, and the declaration IDs of the functions that have an address
+	// annotation. Imports don't need to be listed because they are looked up by name.
+	struct HeaderCacheIndex
+	{
+		struct Dependency
+		{
+			string path;
+			uint64_t size;
+			string digest;
+		};
+		
+		struct Declaration
+		{
+			string name;
+			uint64_t address;
+			uint32_t declID;
+		};
+		
+		vector<Dependency> dependencies;
+		vector<Declaration> exports;
+		vector<Declaration> asmLabels;
+		
+		void addDependencies(ASTUnit& tu)
+		{
+			auto& sourceManager = tu.getSourceManager();
+			for (auto iter = sourceManager.fileinfo_begin(); iter != sourceManager.fileinfo_end(); ++iter)
+			{
+				// Files that can't be read, like the <fcd> buffer, are already part of the cache key.
+				StringRef path = iter->first->getName();
+				if (auto buffer = MemoryBuffer::getFile(path))
+				{
+					StringRef contents = buffer.get()->getBuffer();
+					dependencies.push_back({path.str(), contents.size(), getDigest(contents)});
+				}
+			}
+		}
+		
+		bool isUpToDate() const
+		{
+			for (const auto& dependency : dependencies)
+			{
+				sys::fs::file_status status;
+				if (sys::fs::status(dependency.path, status) || status.getSize() != dependency.size)
+				{
+					return false;
+				}
+				
+				auto buffer = MemoryBuffer::getFile(dependency.path);
+				if (!buffer || getDigest(buffer.get()->getBuffer()) != dependency.digest)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		// Format: a magic line, then one entry per line:
+		// dep <size> <digest> <path>
+		// export <decl id> <address> <name>
+		// asm <decl id> <symbol name>
+		bool read(StringRef indexPath)
+		{
+			auto bufferOrError = MemoryBuffer::getFile(indexPath);
+			if (!bufferOrError)
+			{
+				return false;
+			}
+			
+			StringRef contents = bufferOrError.get()->getBuffer();
+			StringRef line;
+			tie(line, contents) = contents.split('\n');
+			if (line != cacheIndexMagic)
+			{
+				return false;
+			}
+			
+			while (contents.size() > 0)
+			{
+				StringRef kind, field;
+				tie(line, contents) = contents.split('\n');
+				tie(kind, line) = line.split(' ');
+				if (kind == "dep")
+				{
+					Dependency dependency;
+					tie(field, line) = line.split(' ');
+					if (field.getAsInteger(10, dependency.size))
+					{
+						return false;
+					}
+					tie(field, line) = line.split(' ');
+					dependency.digest = field.str();
+					dependency.path = line.str();
+					dependencies.push_back(move(dependency));
+				}
+				else if (kind == "export")
+				{
+					Declaration declaration;
+					tie(field, line) = line.split(' ');
+					if (field.getAsInteger(10, declaration.declID))
+					{
+						return false;
+					}
+					tie(field, line) = line.split(' ');
+					if (field.getAsInteger(10, declaration.address))
+					{
+						return false;
+					}
+					declaration.name = line.str();
+					exports.push_back(move(declaration));
+				}
+				else if (kind == "asm")
+				{
+					Declaration declaration;
+					tie(field, line) = line.split(' ');
+					if (field.getAsInteger(10, declaration.declID))
+					{
+						return false;
+					}
+					declaration.address = 0;
+					declaration.name = line.str();
+					asmLabels.push_back(move(declaration));
+				}
+				else
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		bool write(StringRef indexPath) const
+		{
+			// Write to a temporary file and move it in place, so that concurrent fcd processes never see a partial
+			// index.
+			int fd;
+			SmallString<128> tempPath;
+			if (sys::fs::createUniqueFile(indexPath + "-%%%%%%%%", fd, tempPath))
+			{
+				return false;
+			}
+			
+			bool written;
+			{
+				raw_fd_ostream indexOutput(fd, true);
+				indexOutput << cacheIndexMagic << '\n';
+				for (const auto& dependency : dependencies)
+				{
+					indexOutput << "dep " << dependency.size << ' ' << dependency.digest << ' ' << dependency.path << '\n';
+				}
+				for (const auto& declaration : exports)
+				{
+					indexOutput << "export " << declaration.declID << ' ' << declaration.address << ' ' << declaration.name << '\n';
+				}
+				for (const auto& declaration : asmLabels)
+				{
+					indexOutput << "asm " << declaration.declID << ' ' << declaration.name << '\n';
+				}
+				indexOutput.close();
+				written = !indexOutput.has_error();
+				indexOutput.clear_error();
+			}
+			
+			if (!written || sys::fs::rename(tempPath, indexPath))
+			{
+				sys::fs::remove(tempPath);
+				return false;
+			}
+			return true;
+		}
+	};
+	
+	// Imports are looked up by identifier when they are needed, so this only has to find functions that have an
+	// address annotation, and functions whose asm label makes their symbol name differ from their identifier (like
+	// glibc's __REDIRECT or Darwin's $UNIX2003 variants). Names are only computed for those.
 	class FunctionDeclarationFinder : public RecursiveASTVisitor<FunctionDeclarationFinder>
 	{
 		index::CodegenNameGenerator& mangler;
-		unordered_map<string, FunctionDecl*>& knownImports;
 		unordered_map<uint64_t, HeaderDeclarations::Export>& knownExports;
+		StringSet<BumpPtrAllocator>& exportNames;
+		unordered_map<string, FunctionDecl*>& asmLabels;
 		
 	public:
-		FunctionDeclarationFinder(index::CodegenNameGenerator& mangler, unordered_map<string, FunctionDecl*>& knownImports, unordered_map<uint64_t, HeaderDeclarations::Export>& knownExports)
-		: mangler(mangler), knownImports(knownImports), knownExports(knownExports)
+		FunctionDeclarationFinder(index::CodegenNameGenerator& mangler, unordered_map<uint64_t, HeaderDeclarations::Export>& knownExports, StringSet<BumpPtrAllocator>& exportNames, unordered_map<string, FunctionDecl*>& asmLabels)
+		: mangler(mangler), knownExports(knownExports), exportNames(exportNames), asmLabels(asmLabels)
 		{
 		}
 		
@@ -113,9 +334,18 @@ namespace
 		
 		bool TraverseFunctionDecl(FunctionDecl* fn)
 		{
+			bool hasAsmLabel = fn->hasAttr<AsmLabelAttr>();
+			if (!hasAsmLabel && !fn->hasAttr<AnnotateAttr>())
+			{
+				return true;
+			}
+			
 			string mangledName = mangler.getName(fn);
+			if (hasAsmLabel)
+			{
+				asmLabels.insert({mangledName, fn});
+			}
 			
-			bool foundAddress = false;
 			static const char fcdPrefix[] = "fcd.";
 			static const char addressPrefix[] = "fcd.virtualaddress:";
 			for (auto attribute : fn->specific_attrs<AnnotateAttr>())
@@ -135,7 +365,7 @@ namespace
 							errs().write_hex(address);
 							errs() << '\n';
 						}
-						exported.name = mangledName;
+						exported.name = exportNames.insert(mangledName).first->getKey();
 						exported.virtualAddress = address;
 						exported.decl = fn;
 					}
@@ -145,22 +375,21 @@ namespace
 					errs() << "Function " << mangledName << " has unknown fcd attribute annotation " << value << '\n';
 				}
 			}
-			
-			if (!foundAddress)
-			{
-				knownImports[mangledName] = fn;
-			}
 			return true;
 		}
 	};
 }
 
 HeaderDeclarations::HeaderDeclarations(llvm::Module& module, unique_ptr<ASTUnit> tu, vector<string> includedFiles)
-: module(module), tu(move(tu)), includedFiles(move(includedFiles))
+: module(&module), tu(move(tu)), includedFiles(move(includedFiles))
 {
+	if (this->tu)
+	{
+		mangler.reset(new index::CodegenNameGenerator(this->tu->getASTContext()));
+	}
 }
 
-unique_ptr<HeaderDeclarations> HeaderDeclarations::create(llvm::Module& module, const vector<string>& searchPath, vector<string> headers, const vector<string>& frameworks, raw_ostream& errors)
+unique_ptr<HeaderDeclarations> HeaderDeclarations::create(llvm::Module& module, const vector<string>& searchPath, vector<string> headers, const vector<string>& frameworks, raw_ostream& errors, const string& cacheDirectory)
 {
 	if (headers.size() == 0)
 	{
@@ -187,6 +416,7 @@ unique_ptr<HeaderDeclarations> HeaderDeclarations::create(llvm::Module& module,
 		auto diags = CompilerInstance::createDiagnostics(diagOpts.release(), diagPrinter);
 		
 		shared_ptr<CompilerInvocation> clang;
+		string cacheKey;
 		{
 			// It might seem lazy to use CreateFromArgs to specify frameworks, but no one has been able to tell me how to
 			// do it without using -framework.
@@ -213,6 +443,11 @@ unique_ptr<HeaderDeclarations> HeaderDeclarations::create(llvm::Module& module,
 			
 			auto frameworkArgsArrayRef = makeArrayRef(&*cInvocationArgs.begin(), &*cInvocationArgs.end());
 			clang = createInvocationFromCommandLine(frameworkArgsArrayRef, diags);
+			
+			if (cacheDirectory.size() > 0)
+			{
+				cacheKey = getCacheKey(invocationArgs, searchPath, includeContent, module.getTargetTriple());
+			}
 		}
 		
 		if (clang)
@@ -244,7 +479,50 @@ unique_ptr<HeaderDeclarations> HeaderDeclarations::create(llvm::Module& module,
 			preprocessorOpts.addRemappedFile("<fcd>", includeBuffer.release());
 			
 			auto pch = std::make_shared<PCHContainerOperations>();
-			auto tu = ASTUnit::LoadFromCompilerInvocation(clang, pch, diags, new FileManager(FileSystemOptions()), true);
+			unique_ptr<ASTUnit> tu;
+			HeaderCacheIndex cacheIndex;
+			SmallString<128> astPath;
+			SmallString<128> indexPath;
+			bool loadedFromCache = false;
+			bool savedToCache = false;
+			if (cacheKey.size() > 0)
+			{
+				astPath = cacheDirectory;
+				sys::path::append(astPath, cacheKey + ".ast");
+				indexPath = cacheDirectory;
+				sys::path::append(indexPath, cacheKey + ".index");
+				if (cacheIndex.read(indexPath) && cacheIndex.isUpToDate())
+				{
+					PrettyStackTraceFormat loadingCache("Loading cached header declarations from \"%s\"", astPath.c_str());
+					tu = ASTUnit::LoadFromASTFile(astPath.str(), pch->getRawReader(), diags, FileSystemOptions());
+					loadedFromCache = tu != nullptr;
+				}
+				
+				if (!loadedFromCache)
+				{
+					cacheIndex = HeaderCacheIndex();
+				}
+			}
+			
+			if (!loadedFromCache)
+			{
+				tu = ASTUnit::LoadFromCompilerInvocation(clang, pch, diags, new FileManager(FileSystemOptions()), true);
+				if (tu && diagPrinter->getNumErrors() == 0 && cacheKey.size() > 0)
+				{
+					// Declaration IDs are only meaningful for declarations that come from an AST file, so continue with
+					// the AST that was just saved. (ASTUnit::Save returns true on failure.)
+					cacheIndex.addDependencies(*tu);
+					if (!sys::fs::create_directories(cacheDirectory) && !tu->Save(astPath))
+					{
+						if (auto savedTu = ASTUnit::LoadFromASTFile(astPath.str(), pch->getRawReader(), diags, FileSystemOptions()))
+						{
+							tu = move(savedTu);
+							savedToCache = true;
+						}
+					}
+				}
+			}
+			
 			if (diagPrinter->getNumErrors() == 0)
 			{
 				if (tu)
@@ -255,9 +533,42 @@ unique_ptr<HeaderDeclarations> HeaderDeclarations::create(llvm::Module& module,
 						codegen->Initialize(result->tu->getASTContext());
 						result->codeGenerator.reset(codegen);
 						result->typeLowering.reset(new CodeGen::CodeGenTypes(codegen->CGM()));
-						index::CodegenNameGenerator mangler(result->tu->getASTContext());
-						FunctionDeclarationFinder visitor(mangler, result->knownImports, result->knownExports);
-						visitor.TraverseDecl(result->tu->getASTContext().getTranslationUnitDecl());
+						if (loadedFromCache)
+						{
+							// Only deserialize the declarations that the index points to.
+							auto& externalSource = *result->tu->getASTContext().getExternalSource();
+							for (const auto& declaration : cacheIndex.exports)
+							{
+								if (auto decl = dyn_cast_or_null<FunctionDecl>(externalSource.GetExternalDecl(declaration.declID)))
+								{
+									auto& exported = result->knownExports[declaration.address];
+									exported.name = result->exportNames.insert(declaration.name).first->getKey();
+									exported.virtualAddress = declaration.address;
+									exported.decl = decl;
+								}
+							}
+							for (const auto& declaration : cacheIndex.asmLabels)
+							{
+								result->asmLabelDeclIDs.insert({declaration.name, declaration.declID});
+							}
+						}
+						else
+						{
+							FunctionDeclarationFinder visitor(*result->mangler, result->knownExports, result->exportNames, result->asmLabels);
+							visitor.TraverseDecl(result->tu->getASTContext().getTranslationUnitDecl());
+							if (savedToCache)
+							{
+								for (const auto& pair : result->knownExports)
+								{
+									cacheIndex.exports.push_back({pair.second.name.str(), pair.first, pair.second.decl->getGlobalID()});
+								}
+								for (const auto& pair : result->asmLabels)
+								{
+									cacheIndex.asmLabels.push_back({pair.first, 0, pair.second->getGlobalID()});
+								}
+								cacheIndex.write(indexPath);
+							}
+						}
 						return result;
 					}
 					else
@@ -315,7 +626,7 @@ Function* HeaderDeclarations::prototypeForDeclaration(FunctionDecl& decl)
 	}
 	
 	Function* fn = Function::Create(functionType, GlobalValue::ExternalLinkage);
-	fn->addAttributes(AttributeSet::FunctionIndex, AttributeSet::get(module.getContext(), AttributeSet::FunctionIndex, attributeBuilder));
+	fn->addAttributes(AttributeSet::FunctionIndex, AttributeSet::get(module->getContext(), AttributeSet::FunctionIndex, attributeBuilder));
 	if (decl.hasAttr<RestrictAttr>())
 	{
 		fn->addAttribute(AttributeSet::ReturnIndex, Attribute::NoAlias);
@@ -326,13 +637,61 @@ Function* HeaderDeclarations::prototypeForDeclaration(FunctionDecl& decl)
 	auto callingConvention = lookupCallingConvention(prototype->getExtInfo().getCC());
 	
 	fn->setCallingConv(callingConvention);
-	module.getFunctionList().insert(module.getFunctionList().end(), fn);
+	module->getFunctionList().insert(module->getFunctionList().end(), fn);
 	return fn;
 }
 
+FunctionDecl* HeaderDeclarations::lookupImport(StringRef importName)
+{
+	if (!tu)
+	{
+		return nullptr;
+	}
+	
+	// Look up the identifier in the translation unit instead of walking every declaration. On AST files, this only
+	// deserializes the declarations that have that name. The symbol name may have the platform's global prefix, so
+	// the name is checked against the mangled name of what's found.
+	auto& astContext = tu->getASTContext();
+	auto translationUnit = astContext.getTranslationUnitDecl();
+	SmallVector<StringRef, 2> identifiers = { importName };
+	if (importName.startswith("_"))
+	{
+		identifiers.push_back(importName.drop_front());
+	}
+	
+	for (StringRef identifier : identifiers)
+	{
+		for (NamedDecl* decl : translationUnit->lookup(DeclarationName(&astContext.Idents.get(identifier))))
+		{
+			if (auto fn = dyn_cast<FunctionDecl>(decl))
+			if (mangler->getName(fn) == importName)
+			{
+				return fn;
+			}
+		}
+	}
+	
+	// Declarations with an asm label can't be found by identifier.
+	auto labelIter = asmLabels.find(importName.str());
+	if (labelIter != asmLabels.end())
+	{
+		return labelIter->second;
+	}
+	
+	auto idIter = asmLabelDeclIDs.find(importName.str());
+	if (idIter != asmLabelDeclIDs.end())
+	{
+		if (auto externalSource = astContext.getExternalSource())
+		{
+			return dyn_cast_or_null<FunctionDecl>(externalSource->GetExternalDecl(idIter->second));
+		}
+	}
+	return nullptr;
+}
+
 Function* HeaderDeclarations::prototypeForImportName(const string& importName)
 {
-	if (Function* fn = module.getFunction(importName))
+	if (Function* fn = module->getFunction(importName))
 	{
 		return fn;
 	}
@@ -340,10 +699,10 @@ Function* HeaderDeclarations::prototypeForImportName(const string& importName)
 	auto iter = knownImports.find(importName);
 	if (iter == knownImports.end())
 	{
-		return nullptr;
+		iter = knownImports.insert({importName, lookupImport(importName)}).first;
 	}
 	
-	return prototypeForDeclaration(*iter->second);
+	return iter->second == nullptr ? nullptr : prototypeForDeclaration(*iter->second);
 }
 
 Function* HeaderDeclarations::prototypeForAddress(uint64_t address)
@@ -13,6 +13,7 @@
 #include "entry_points.h"
 
 #include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/Pass.h>
@@ -33,6 +34,10 @@ namespace clang
 		class CodeGenTypes;
 	}
 	class FunctionDecl;
+	namespace index
+	{
+		class CodegenNameGenerator;
+	}
 }
 
 class HeaderDeclarations : public EntryPointProvider
@@ -44,32 +49,47 @@ public:
 	};
 	
 private:
-	llvm::Module& module;
+	llvm::Module* module;
 	std::unique_ptr<clang::ASTUnit> tu;
 	std::unique_ptr<clang::CodeGenerator> codeGenerator;
 	std::unique_ptr<clang::CodeGen::CodeGenTypes> typeLowering;
+	std::unique_ptr<clang::index::CodegenNameGenerator> mangler;
 	
 	std::vector<std::string> includedFiles;
+	// Filled as prototypeForImportName looks up names; names that the headers don't declare map to nullptr.
 	std::unordered_map<std::string, clang::FunctionDecl*> knownImports;
+	// Symbol names of declarations that have an asm label, which lookupImport can't find by identifier. Found while
+	// walking the headers, or read by declaration ID from the header cache index and deserialized on demand.
+	std::unordered_map<std::string, clang::FunctionDecl*> asmLabels;
+	std::unordered_map<std::string, uint32_t> asmLabelDeclIDs;
 	std::unordered_map<uint64_t, Export> knownExports;
+	llvm::StringSet<llvm::BumpPtrAllocator> exportNames;
 	
 	HeaderDeclarations(llvm::Module& module, std::unique_ptr<clang::ASTUnit> tu, std::vector<std::string> includedFiles);
 	
 	llvm::Function* prototypeForDeclaration(clang::FunctionDecl& decl);
+	clang::FunctionDecl* lookupImport(llvm::StringRef importName);
 	
 public:
-	static std::unique_ptr<HeaderDeclarations> create(llvm::Module& module, const std::vector<std::string>& searchPath, std::vector<std::string> headers, const std::vector<std::string>& frameworks, llvm::raw_ostream& errors);
+	// When cacheDirectory is not empty, the parsed headers are saved there as an AST file along with an index of
+	// the functions that they declare. Later runs with the same arguments load the AST file instead of parsing the
+	// headers again, as long as none of the files that the headers included has changed.
+	static std::unique_ptr<HeaderDeclarations> create(llvm::Module& module, const std::vector<std::string>& searchPath, std::vector<std::string> headers, const std::vector<std::string>& frameworks, llvm::raw_ostream& errors, const std::string& cacheDirectory = std::string());
 	
 	template<typename TSearchPathIter, typename THeaderIter, typename TFrameworkIter>
-	static std::unique_ptr<HeaderDeclarations> create(llvm::Module& module, TSearchPathIter searchPathBegin, TSearchPathIter searchPathEnd, THeaderIter headerBegin, THeaderIter headerEnd, TFrameworkIter frameworkBegin, TFrameworkIter frameworkEnd, llvm::raw_ostream& errors)
+	static std::unique_ptr<HeaderDeclarations> create(llvm::Module& module, TSearchPathIter searchPathBegin, TSearchPathIter searchPathEnd, THeaderIter headerBegin, THeaderIter headerEnd, TFrameworkIter frameworkBegin, TFrameworkIter frameworkEnd, llvm::raw_ostream& errors, const std::string& cacheDirectory = std::string())
 	{
 		return create(module,
 			std::vector<std::string>(searchPathBegin, searchPathEnd),
 			std::vector<std::string>(headerBegin, headerEnd),
 			std::vector<std::string>(frameworkBegin, frameworkEnd),
-			errors);
+			errors,
+			cacheDirectory);
 	}
 	
+	// Prototypes are created in module from then on. It must use the same LLVMContext and target.
+	void setModule(llvm::Module& module) { this->module = &module; }
+	
 	const std::vector<std::string>& getIncludedFiles() const { return includedFiles; }
 	llvm::Function* prototypeForImportName(const std::string& importName);
 	llvm::Function* prototypeForAddress(uint64_t address);
@@ -8,16 +8,24 @@
 //
 
 #include "ast_passes.h"
+#include "capstone_wrapper.h"
 #include "command_line.h"
+#include "decompilation_server.h"
+#include "dumb_allocator.h"
 #include "errors.h"
 #include "executable.h"
+#include "executable_file.h"
+#include "function_cache.h"
+#include "function_pass_pool.h"
 #include "header_decls.h"
 #include "main.h"
 #include "metadata.h"
+#include "module_checkpoints.h"
 #include "passes.h"
 #include "params_registry.h"
 #include "python_context.h"
 #include "translation_context.h"
+#include "translation_pool.h"
 
 #include <llvm/Analysis/AliasAnalysis.h>
 #include <llvm/Analysis/BasicAliasAnalysis.h>
@@ -30,6 +38,7 @@
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/PrettyStackTrace.h>
@@ -37,20 +46,30 @@
 #include <llvm/Support/raw_os_ostream.h>
 #include <llvm/Support/Signals.h>
 #include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Scalar/GVN.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <unordered_map>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <sys/resource.h>
+
 using namespace llvm;
 using namespace std;
 
@@ -64,9 +83,13 @@ raw_ostream& llvm_errs()
 
 namespace
 {
-	cl::opt<string> inputFile(cl::Positional, cl::desc("<input program>"), cl::Required, whitelist());
+	cl::opt<string> inputFile(cl::Positional, cl::desc("<input program>"), whitelist());
+	cl::opt<string> serveSocket("serve", cl::desc("Keep running and answer JSON requests on the Unix domain socket at <path>, keeping the executable and the functions that were asked for in memory between requests"), cl::value_desc("path"), whitelist());
+	cl::opt<string> batchListFile("batch", cl::desc("Decompile every input listed in <file>, one per line. A line can give an output path after a tab; otherwise, output goes to the input path with a .c or .ll extension appended"), cl::value_desc("file"), whitelist());
 	cl::list<unsigned long long> additionalEntryPoints("other-entry", cl::desc("Add entry point from virtual address (can be used multiple times)"), cl::CommaSeparated, whitelist());
 	cl::list<bool> partialDisassembly("partial", cl::desc("Only decompile functions specified with --other-entry"), whitelist());
+	cl::opt<unsigned> calleeDepth("callee-depth", cl::desc("With --partial, how many levels of callees to lift so that argument recovery can look into them"), cl::value_desc("N"), cl::init(1), whitelist());
+	cl::opt<unsigned> liftingBudget("lifting-budget", cl::desc("With --partial, stop lifting more levels of callees after <seconds> of lifting (0 doesn't limit lifting)"), cl::value_desc("seconds"), cl::init(0), whitelist());
 	cl::list<bool> inputIsModule("module-in", cl::desc("Input file is a LLVM module"), whitelist());
 	cl::list<bool> outputIsModule("module-out", cl::desc("Output LLVM module"), whitelist());
 	
@@ -76,12 +99,22 @@ namespace
 	cl::list<string> headers("header", cl::desc("Path of a header file to parse for function declarations. Can be specified multiple times"), whitelist());
 	cl::list<string> frameworks("framework", cl::desc("Path of an Apple framework that fcd should use for declarations. Can be specified multiple times"), whitelist());
 	cl::list<string> headerSearchPath("I", cl::desc("Additional directory to search headers in. Can be specified multiple times"), whitelist());
+	cl::opt<string> headerCacheDirectory("header-cache", cl::desc("Directory where parsed header declarations are kept between runs"), cl::value_desc("dir"), whitelist());
+	cl::opt<string> checkpointDirectory("checkpoint-dir", cl::desc("Directory where the module is saved as bitcode after lifting and after optimization; later runs on the same input resume from the latest checkpoint that their options allow"), cl::value_desc("dir"), whitelist());
+	cl::opt<string> functionCacheDirectory("cache-dir", cl::desc("Directory where the pseudocode of functions is kept between runs; functions whose code didn't change are not lifted again"), cl::value_desc("dir"), whitelist());
+	
+	cl::opt<bool> rerunUnchangedFunctions("rerun-unchanged", cl::desc("Run every function pass of the pipeline on every function, even on functions that didn't change since the pass last ran on them"), whitelist());
+	cl::opt<bool> timePhases("time-phases", cl::desc("Report the time and memory that each decompilation phase takes"), whitelist());
+	cl::opt<string> timePhasesJson("time-phases-json", cl::desc("Write the --time-phases report as JSON to <file> instead of printing it"), cl::value_desc("file"), whitelist());
+	
+	cl::opt<unsigned> jobCount("jobs", cl::desc("Number of worker threads for lifting, optimization and pseudocode generation (0 uses every hardware thread)"), cl::value_desc("N"), cl::init(1), whitelist());
 	
 	cl::alias additionalEntryPointsAlias("e", cl::desc("Alias for --other-entry"), cl::aliasopt(additionalEntryPoints), whitelist());
 	cl::alias partialDisassemblyAlias("p", cl::desc("Alias for --partial"), cl::aliasopt(partialDisassembly), whitelist());
 	cl::alias additionalPassesAlias("O", cl::desc("Alias for --opt"), cl::aliasopt(additionalPasses), whitelist());
 	cl::alias inputIsModuleAlias("m", cl::desc("Alias for --module-in"), cl::aliasopt(inputIsModule), whitelist());
 	cl::alias outputIsModuleAlias("n", cl::desc("Alias for --module-out"), cl::aliasopt(outputIsModule), whitelist());
+	cl::alias jobCountAlias("j", cl::desc("Alias for --jobs"), cl::aliasopt(jobCount), whitelist());
 	
 	template<int (*)()> // templated to ensure multiple instatiation of the static variables
 	inline int optCount(const cl::list<bool>& list)
@@ -159,18 +192,180 @@ namespace
 		return count;
 	}
 	
-	bool refillEntryPoints(const TranslationContext& transl, const EntryPointRepository& entryPoints, map<uint64_t, SymbolInfo>& toVisit, size_t iterations)
+	unsigned getWorkerCount()
+	{
+		if (jobCount == 0)
+		{
+			return max(thread::hardware_concurrency(), 1u);
+		}
+		return jobCount;
+	}
+	
+	bool isTimingPhases()
+	{
+		return timePhases || !timePhasesJson.empty();
+	}
+	
+	uint64_t getPeakResidentBytes()
+	{
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+		{
+			return 0;
+		}
+#ifdef __APPLE__
+		return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+		return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+	}
+	
+	struct PhaseMemoryUsage
+	{
+		string name;
+		uint64_t peakResidentBytes;
+		size_t allocatorBytes;
+	};
+	
+	// One entry per phase, in the order that phases first ran. Phases that run more than once (with --batch or
+	// --serve) keep the highest peak RSS and the sum of their allocator bytes.
+	mutex phaseMemoryUsageMutex;
+	vector<PhaseMemoryUsage> phaseMemoryUsage;
+	
+	void addPhaseMemoryUsage(const string& name, uint64_t peakResidentBytes, size_t allocatorBytes)
+	{
+		lock_guard<mutex> lock(phaseMemoryUsageMutex);
+		auto iter = find_if(phaseMemoryUsage.begin(), phaseMemoryUsage.end(), [&](const PhaseMemoryUsage& usage)
+		{
+			return usage.name == name;
+		});
+		if (iter == phaseMemoryUsage.end())
+		{
+			phaseMemoryUsage.push_back({name, peakResidentBytes, allocatorBytes});
+		}
+		else
+		{
+			iter->peakResidentBytes = max(iter->peakResidentBytes, peakResidentBytes);
+			iter->allocatorBytes += allocatorBytes;
+		}
+	}
+	
+	// Times a decompilation phase and records the memory that it used, if --time-phases is set. The peak RSS is that
+	// of the whole process at the end of the phase; the allocator bytes are the bytes that DumbAllocators reserved
+	// during the phase.
+	class PhaseScope
+	{
+		NamedRegionTimer timer;
+		string phaseName;
+		size_t allocatorBytesAtStart;
+		
+	public:
+		PhaseScope(StringRef name, StringRef description)
+		: timer(name, description, "fcd", "fcd phase timing report", isTimingPhases())
+		, phaseName(name)
+		, allocatorBytesAtStart(DumbAllocator::getTotalReservedBytes())
+		{
+		}
+		
+		~PhaseScope()
+		{
+			if (isTimingPhases())
+			{
+				size_t allocatorBytes = DumbAllocator::getTotalReservedBytes() - allocatorBytesAtStart;
+				addPhaseMemoryUsage(phaseName, getPeakResidentBytes(), allocatorBytes);
+			}
+		}
+	};
+	
+	// Prints the --time-phases report when main returns.
+	class PhaseReport
+	{
+		void printJson(raw_ostream& os)
+		{
+			os << "{\n";
+			const char* delim = TimerGroup::printAllJSONValues(os, "");
+			for (const auto& usage : phaseMemoryUsage)
+			{
+				os << delim << "\t\"fcd." << usage.name << ".peak_rss\": " << usage.peakResidentBytes;
+				delim = ",\n";
+				os << delim << "\t\"fcd." << usage.name << ".allocator_bytes\": " << usage.allocatorBytes;
+			}
+			os << "\n}\n";
+		}
+		
+		void printText(raw_ostream& os)
+		{
+			TimerGroup::printAll(os);
+			
+			os << "===" << string(73, '-') << "===\n";
+			os << "                        fcd phase memory report\n";
+			os << "===" << string(73, '-') << "===\n";
+			os << "  Peak RSS (MB)  Allocator (MB)  Phase\n";
+			for (const auto& usage : phaseMemoryUsage)
+			{
+				double peakResidentMegabytes = static_cast<double>(usage.peakResidentBytes) / (1 << 20);
+				double allocatorMegabytes = static_cast<double>(usage.allocatorBytes) / (1 << 20);
+				os << format("  %13.1f  %14.1f  ", peakResidentMegabytes, allocatorMegabytes);
+				os << usage.name << '\n';
+			}
+			os << '\n';
+		}
+		
+	public:
+		PhaseReport()
+		{
+			// Per-pass timing for LLVM passes and AstBackEnd passes.
+			TimePassesIsEnabled = isTimingPhases();
+		}
+		
+		~PhaseReport()
+		{
+			if (!timePhasesJson.empty())
+			{
+				error_code error;
+				raw_fd_ostream jsonOutput(timePhasesJson, error, sys::fs::F_Text);
+				if (error)
+				{
+					errs() << "can't open " << timePhasesJson << ": " << error.message() << '\n';
+				}
+				else
+				{
+					printJson(jsonOutput);
+				}
+			}
+			else if (timePhases)
+			{
+				printText(errs());
+			}
+		}
+	};
+	
+	// With --partial, callees are lifted so that argument recovery can look into them. Each iteration lifts one more
+	// level of the call graph, until --callee-depth levels or --lifting-budget seconds are used up.
+	bool refillEntryPoints(const unordered_set<uint64_t>& discoveredEntryPoints, const EntryPointRepository& entryPoints, map<uint64_t, const SymbolInfo*>& toVisit, size_t iterations, chrono::steady_clock::time_point liftingStart)
 	{
-		if (isExclusiveDisassembly() || (isPartialDisassembly() && iterations > 1))
+		if (isExclusiveDisassembly())
 		{
 			return false;
 		}
 		
-		for (uint64_t entryPoint : transl.getDiscoveredEntryPoints())
+		if (isPartialDisassembly())
+		{
+			if (iterations > calleeDepth)
+			{
+				return false;
+			}
+			if (liftingBudget > 0 && chrono::steady_clock::now() - liftingStart >= chrono::seconds(liftingBudget.getValue()))
+			{
+				return false;
+			}
+		}
+		
+		for (uint64_t entryPoint : discoveredEntryPoints)
 		{
 			if (auto symbolInfo = entryPoints.getInfo(entryPoint))
 			{
-				toVisit.insert({entryPoint, *symbolInfo});
+				toVisit.insert({entryPoint, symbolInfo});
 			}
 		}
 		return !toVisit.empty();
@@ -181,10 +376,31 @@ namespace
 		int argc;
 		char** argv;
 	
-		LLVMContext llvm;
 		PythonContext python;
+		unsigned workerCount;
+		string headerCache;
+		unique_ptr<FunctionCache> functionCache;
+		string functionCachePipeline;
+		unique_ptr<ModuleCheckpoints> checkpoints;
+		vector<string> optimizeAndTransformPassNames;
+		
+		// Pass managers take ownership of their passes, so each module needs its own instances. The ones created to
+		// validate the pipeline are used for the first module.
+		mutex optimizeAndTransformPassesMutex;
 		vector<Pass*> optimizeAndTransformPasses;
 		
+		vector<Pass*> takeOptimizeAndTransformPasses()
+		{
+			lock_guard<mutex> lock(optimizeAndTransformPassesMutex);
+			vector<Pass*> result;
+			result.swap(optimizeAndTransformPasses);
+			if (result.size() == 0)
+			{
+				result = createPassesFromList(optimizeAndTransformPassNames);
+			}
+			return result;
+		}
+		
 		static void aliasAnalysisHooks(Pass& pass, Function& fn, AAResults& aar)
 		{
 			if (auto prgmem = pass.getAnalysisIfAvailable<ProgramMemoryAAWrapperPass>())
@@ -197,13 +413,18 @@ namespace
 			}
 		}
 	
-		static legacy::PassManager createBasePassManager()
+		static void addBaseAnalyses(legacy::PassManager& pm)
 		{
-			legacy::PassManager pm;
 			pm.add(createTypeBasedAAWrapperPass());
 			pm.add(createScopedNoAliasAAWrapperPass());
 			pm.add(createBasicAAWrapperPass());
 			pm.add(createProgramMemoryAliasAnalysis());
+		}
+		
+		static legacy::PassManager createBasePassManager()
+		{
+			legacy::PassManager pm;
+			addBaseAnalyses(pm);
 			return pm;
 		}
 		
@@ -275,14 +496,14 @@ namespace
 			return result;
 		}
 	
-		vector<Pass*> interactivelyEditPassPipeline(const string& editor, const vector<string>& basePasses)
+		vector<string> interactivelyEditPassPipeline(const string& editor, const vector<string>& basePasses)
 		{
 			int fd;
 			SmallVector<char, 100> path;
 			if (auto errorCode = sys::fs::createTemporaryFile("fcd-pass-pipeline", "txt", fd, path))
 			{
 				errs() << getProgramName() << ": can't open temporary file for editing: " << errorCode.message() << "\n";
-				return vector<Pass*>();
+				return vector<string>();
 			}
 			
 			raw_fd_ostream passListOs(fd, true);
@@ -312,7 +533,7 @@ namespace
 			if (int errorCode = system(editCommand.c_str()))
 			{
 				errs() << getProgramName() << ": interactive pass pipeline: editor returned status code " << errorCode << '\n';
-				return vector<Pass*>();
+				return vector<string>();
 			}
 			
 			ifstream passListIs(path.data());
@@ -330,10 +551,10 @@ namespace
 				lines.push_back(inputLine);
 			}
 			
-			return createPassesFromList(lines);
+			return lines;
 		}
 		
-		vector<Pass*> readPassPipelineFromString(const string& argString)
+		vector<string> readPassPipelineFromString(const string& argString)
 		{
 			stringstream ss(argString, ios::in);
 			vector<string> passes;
@@ -347,50 +568,221 @@ namespace
 					passes.pop_back();
 				}
 			}
-			auto result = createPassesFromList(passes);
-			if (result.size() == 0)
+			if (passes.size() == 0)
 			{
 				errs() << getProgramName() << ": empty custom pass list\n";
 			}
-			return result;
+			return passes;
 		}
 	
 	public:
 		Main(int argc, char** argv)
-		: argc(argc), argv(argv), python(argv[0])
+		: argc(argc), argv(argv), python(argv[0]), workerCount(getWorkerCount()), headerCache(headerCacheDirectory)
 		{
 			(void) argc;
 			(void) this->argc;
+			
+			if (!functionCacheDirectory.empty())
+			{
+				functionCache.reset(new FunctionCache(functionCacheDirectory));
+			}
+			if (!checkpointDirectory.empty())
+			{
+				checkpoints.reset(new ModuleCheckpoints(checkpointDirectory));
+			}
 		}
 	
 		string getProgramName() { return sys::path::stem(argv[0]); }
-		LLVMContext& getContext() { return llvm; }
+		
+		void setWorkerCount(unsigned count) { workerCount = count; }
+		void setHeaderCacheDirectory(string directory) { headerCache = move(directory); }
+		
+		void printFunctionCacheStatistics()
+		{
+			if (functionCache)
+			{
+				functionCache->printStatistics(errs());
+			}
+		}
 	
 		ErrorOr<unique_ptr<Executable>> parseExecutable(MemoryBuffer& executableCode)
 		{
 			auto start = reinterpret_cast<const uint8_t*>(executableCode.getBufferStart());
 			auto end = reinterpret_cast<const uint8_t*>(executableCode.getBufferEnd());
-			return Executable::parse(start, end);
+			auto executable = Executable::parse(start, end);
+			if (executable)
+			{
+				adviseExecutableAccess(executableCode, *executable.get());
+			}
+			return executable;
 		}
 		
-		ErrorOr<unique_ptr<Module>> generateAnnotatedModule(Executable& executable, const string& moduleName = "fcd-out")
+		error_code liftInParallel(Executable& executable, const x86_config& config, const string& moduleName, Module& module, HeaderDeclarations& cDecls, const EntryPointRepository& entryPoints, map<uint64_t, const SymbolInfo*>& toVisit)
 		{
-			x86_config config64 = { x86_isa64, 8, X86_REG_RIP, X86_REG_RSP, X86_REG_RBP };
-			TranslationContext transl(llvm, executable, config64, moduleName);
+			TranslationPool pool(executable, config, moduleName, workerCount);
+			auto liftingStart = chrono::steady_clock::now();
+			size_t iterations = 0;
+			do
+			{
+				if (!pool.createFunctions(toVisit))
+				{
+					return make_error_code(FcdError::Main_DecompilationError);
+				}
+				toVisit.clear();
+				iterations++;
+			}
+			while (refillEntryPoints(pool.getDiscoveredEntryPoints(), entryPoints, toVisit, iterations, liftingStart));
 			
-			// Load headers here, since this is the earliest point where we have an executable and a module.
-			auto cDecls = HeaderDeclarations::create(
-				transl.get(),
+			if (!pool.linkInto(module))
+			{
+				return make_error_code(FcdError::Main_ModuleLinkingError);
+			}
+			
+			for (Function& fn : module)
+			{
+				if (!md::isPrototype(fn))
+				if (auto address = md::getVirtualAddress(fn))
+				if (Function* cFunction = cDecls.prototypeForAddress(address->getLimitedValue()))
+				{
+					md::setFinalPrototype(fn, *cFunction);
+				}
+			}
+			return error_code();
+		}
+		
+		// Looks up the functions that are about to be lifted in the function cache. Entries are valid when every callee
+		// that they recorded has a valid entry too, with the same call information. Functions with a valid entry are
+		// taken out of toVisit and their pseudocode goes into cachedOutputs, unless a function that is lifted calls
+		// them, since its parameters are recovered from the code of its callees.
+		void takeCachedFunctions(const Executable& executable, map<uint64_t, const SymbolInfo*>& toVisit, unordered_map<uint64_t, string>& keys, map<uint64_t, string>& cachedOutputs)
+		{
+			unordered_map<uint64_t, vector<uint64_t>> callees;
+			unordered_map<uint64_t, FunctionCache::Entry> entries;
+			for (const auto& pair : toVisit)
+			{
+				string key = functionCache->getKey(executable, pair.first, functionCachePipeline, callees[pair.first]);
+				if (!key.empty())
+				{
+					FunctionCache::Entry entry;
+					if (functionCache->lookup(key, entry))
+					{
+						entries.insert({pair.first, move(entry)});
+					}
+					keys.insert({pair.first, move(key)});
+				}
+			}
+			
+			bool changed;
+			do
+			{
+				changed = false;
+				for (auto iter = entries.begin(); iter != entries.end(); )
+				{
+					bool valid = all_of(iter->second.calleeCallInformation.begin(), iter->second.calleeCallInformation.end(), [&](const pair<const uint64_t, string>& callee)
+					{
+						auto calleeEntry = entries.find(callee.first);
+						return calleeEntry != entries.end() && calleeEntry->second.callInformation == callee.second;
+					});
+					if (valid)
+					{
+						++iter;
+					}
+					else
+					{
+						iter = entries.erase(iter);
+						changed = true;
+					}
+				}
+			}
+			while (changed);
+			
+			// The back-end checks the entries of functions that are lifted anyway once their parameters are recovered.
+			do
+			{
+				changed = false;
+				for (const auto& pair : toVisit)
+				{
+					if (entries.count(pair.first) == 0)
+					{
+						for (uint64_t callee : callees[pair.first])
+						{
+							if (entries.erase(callee) != 0)
+							{
+								changed = true;
+							}
+						}
+					}
+				}
+			}
+			while (changed);
+			
+			for (auto& pair : entries)
+			{
+				toVisit.erase(pair.first);
+				cachedOutputs.insert({pair.first, move(pair.second.output)});
+			}
+		}
+		
+		// Functions that were lifted without being looked up first get their key here.
+		void setCacheKeys(const Executable& executable, Module& module, unordered_map<uint64_t, string>& keys)
+		{
+			vector<uint64_t> callees;
+			for (Function& fn : module)
+			{
+				if (!md::isPrototype(fn))
+				if (auto address = md::getVirtualAddress(fn))
+				{
+					string& key = keys[address->getLimitedValue()];
+					if (key.empty())
+					{
+						key = functionCache->getKey(executable, address->getLimitedValue(), functionCachePipeline, callees);
+					}
+					if (!key.empty())
+					{
+						md::setCacheKey(fn, key);
+					}
+				}
+			}
+		}
+		
+		unique_ptr<HeaderDeclarations> parseHeaders(Module& module)
+		{
+			PhaseScope phase("headers", "Header parsing");
+			return HeaderDeclarations::create(
+				module,
 				headerSearchPath.begin(),
 				headerSearchPath.end(),
 				headers.begin(),
 				headers.end(),
 				frameworks.begin(),
 				frameworks.end(),
-				errs());
-			if (!cDecls)
+				errs(),
+				headerCache);
+		}
+		
+		// When sessionHeaders is null, headers are parsed for this module only. When cachedOutputs isn't null, functions
+		// are looked up in the function cache before they are lifted, and the ones that don't need to be lifted go
+		// there instead of into the module.
+		ErrorOr<unique_ptr<Module>> generateAnnotatedModule(LLVMContext& context, Executable& executable, const string& moduleName = "fcd-out", HeaderDeclarations* sessionHeaders = nullptr, map<uint64_t, string>* cachedOutputs = nullptr)
+		{
+			x86_config config64 = { x86_isa64, 8, X86_REG_RIP, X86_REG_RSP, X86_REG_RBP };
+			TranslationContext transl(context, executable, config64, moduleName);
+			
+			// Load headers here, since this is the earliest point where we have an executable and a module.
+			unique_ptr<HeaderDeclarations> moduleHeaders;
+			HeaderDeclarations* cDecls = sessionHeaders;
+			if (cDecls == nullptr)
+			{
+				moduleHeaders = parseHeaders(transl.get());
+				if (!moduleHeaders)
+				{
+					return make_error_code(FcdError::Main_HeaderParsingError);
+				}
+				cDecls = moduleHeaders.get();
+			}
+			else
 			{
-				return make_error_code(FcdError::Main_HeaderParsingError);
+				cDecls->setModule(transl.get());
 			}
 			
 			EntryPointRepository entryPoints;
@@ -399,14 +791,16 @@ namespace
 			
 			md::addIncludedFiles(transl.get(), cDecls->getIncludedFiles());
 	
-			map<uint64_t, SymbolInfo> toVisit;
+			// Symbols stay with their provider; only pointers to them are queued.
+			map<uint64_t, const SymbolInfo*> toVisit;
 			if (isFullDisassembly())
 			{
+				// Entry points come sorted, so each one goes at the end of the map.
 				for (uint64_t address : entryPoints.getVisibleEntryPoints())
 				{
 					auto symbolInfo = entryPoints.getInfo(address);
 					assert(symbolInfo != nullptr);
-					toVisit.insert({symbolInfo->virtualAddress, *symbolInfo});
+					toVisit.emplace_hint(toVisit.end(), symbolInfo->virtualAddress, symbolInfo);
 				}
 			}
 	
@@ -414,7 +808,7 @@ namespace
 			{
 				if (auto symbolInfo = entryPoints.getInfo(address))
 				{
-					toVisit.insert({symbolInfo->virtualAddress, *symbolInfo});
+					toVisit.insert({symbolInfo->virtualAddress, symbolInfo});
 				}
 				else
 				{
@@ -426,37 +820,66 @@ namespace
 			{
 				return make_error_code(FcdError::Main_NoEntryPoint);
 			}
+			
+			unordered_map<uint64_t, string> cacheKeys;
+			if (functionCache && cachedOutputs != nullptr)
+			{
+				PhaseScope phase("function-cache", "Function cache lookup");
+				takeCachedFunctions(executable, toVisit, cacheKeys, *cachedOutputs);
+			}
 	
-			size_t iterations = 0;
-			do
 			{
-				while (toVisit.size() > 0)
+				PhaseScope phase("lifting", "Lifting");
+				
+				// Lifting workers map addresses through the executable, and scripted executables call into the Python
+				// interpreter to do it, which can only be used from one thread at a time.
+				if (workerCount > 1 && !Executable::isScripted())
 				{
-					auto iter = toVisit.begin();
-					auto functionInfo = iter->second;
-					toVisit.erase(iter);
-			
-					if (functionInfo.name.size() > 0)
+					if (auto error = liftInParallel(executable, config64, moduleName, transl.get(), *cDecls, entryPoints, toVisit))
 					{
-						transl.setFunctionName(functionInfo.virtualAddress, functionInfo.name);
+						return error;
 					}
-					
-					if (Function* fn = transl.createFunction(functionInfo.virtualAddress))
+				}
+				else
+				{
+					auto liftingStart = chrono::steady_clock::now();
+					size_t iterations = 0;
+					do
 					{
-						if (Function* cFunction = cDecls->prototypeForAddress(functionInfo.virtualAddress))
+						while (toVisit.size() > 0)
 						{
-							md::setFinalPrototype(*fn, *cFunction);
+							auto iter = toVisit.begin();
+							const SymbolInfo& functionInfo = *iter->second;
+							toVisit.erase(iter);
+					
+							if (functionInfo.name.size() > 0)
+							{
+								transl.setFunctionName(functionInfo.virtualAddress, functionInfo.name);
+							}
+							
+							if (Function* fn = transl.createFunction(functionInfo.virtualAddress))
+							{
+								if (Function* cFunction = cDecls->prototypeForAddress(functionInfo.virtualAddress))
+								{
+									md::setFinalPrototype(*fn, *cFunction);
+								}
+							}
+							else
+							{
+								// Couldn't decompile, abort
+								return make_error_code(FcdError::Main_DecompilationError);
+							}
 						}
+						iterations++;
 					}
-					else
-					{
-						// Couldn't decompile, abort
-						return make_error_code(FcdError::Main_DecompilationError);
-					}
+					while (refillEntryPoints(transl.getDiscoveredEntryPoints(), entryPoints, toVisit, iterations, liftingStart));
 				}
-				iterations++;
 			}
-			while (refillEntryPoints(transl, entryPoints, toVisit, iterations));
+			
+			if (functionCache)
+			{
+				setCacheKeys(executable, transl.get(), cacheKeys);
+			}
 	
 			// Perform early optimizations to make the module suitable for analysis
 			auto module = transl.take();
@@ -469,7 +892,10 @@ namespace
 			phaseOne.add(createDeadStoreEliminationPass());
 			phaseOne.add(createInstructionCombiningPass());
 			phaseOne.add(createGlobalDCEPass());
-			phaseOne.run(*module);
+			{
+				PhaseScope phase("phase-one", "Early optimizations");
+				phaseOne.run(*module);
+			}
 	
 			// Annotate stubs before returning module
 			Function* jumpIntrin = module->getFunction("x86_jump_intrin");
@@ -513,53 +939,398 @@ namespace
 			return move(module);
 		}
 		
-		bool optimizeAndTransformModule(Module& module, raw_ostream& errorOutput, Executable* executable = nullptr)
+		void runPasses(Module& module, Executable* executable, vector<Pass*> passes, bool withParameterRegistry)
 		{
-			PrettyStackTraceString optimize("Optimizing LLVM IR");
-			
-			// Phase 3: make into functions with arguments, run codegen.
 			auto passManager = createBasePassManager();
 			passManager.add(new ExecutableWrapper(executable));
-			passManager.add(createParameterRegistryPass());
+			if (withParameterRegistry)
+			{
+				passManager.add(createParameterRegistryPass(workerCount));
+			}
 			passManager.add(createExternalAAWrapperPass(&Main::aliasAnalysisHooks));
-			for (Pass* pass : optimizeAndTransformPasses)
+			if (!rerunUnchangedFunctions)
+			{
+				passes = createChangeDrivenPipeline(passes);
+			}
+			for (Pass* pass : passes)
 			{
 				passManager.add(pass);
 			}
 			passManager.run(module);
-	
-#ifdef FCD_DEBUG
-			if (verifyModule(module, &errorOutput))
+		}
+		
+		// Workers create their own instances of the passes, so the ones of the pipeline only say which passes to run.
+		bool runFunctionPassesInParallel(Module& module, Executable* executable, const vector<Pass*>& passes)
+		{
+			vector<const PassInfo*> passInfos;
+			for (Pass* pass : passes)
 			{
-				// errors!
-				return false;
+				passInfos.push_back(PassRegistry::getPassRegistry()->getPassInfo(pass->getPassID()));
+				delete pass;
 			}
-#endif
-			return true;
+			
+			auto setupAnalyses = [=](legacy::PassManager& pm)
+			{
+				addBaseAnalyses(pm);
+				pm.add(new ExecutableWrapper(executable));
+				pm.add(createExternalAAWrapperPass(&Main::aliasAnalysisHooks));
+			};
+			
+			auto createPasses = [=]
+			{
+				vector<Pass*> result;
+				for (const PassInfo* info : passInfos)
+				{
+					result.push_back(info->createPass());
+				}
+				return rerunUnchangedFunctions ? result : createChangeDrivenPipeline(result);
+			};
+			
+			FunctionPassPool pool(workerCount, setupAnalyses, createPasses);
+			return pool.run(module);
 		}
-
-		bool generateEquivalentPseudocode(Module& module, raw_ostream& output)
+		
+		bool optimizeAndTransformModule(Module& module, raw_ostream& errorOutput, Executable* executable = nullptr)
 		{
-			PrettyStackTraceString pseudocode("Generating pseudo-C output");
+			PrettyStackTraceString optimize("Optimizing LLVM IR");
 			
-			// Run that module through the output pass
-			// UnwrapReturns happens after value propagation because value propagation doesn't know that calls
-			// are generally not safe to reorder.
-			AstBackEnd* backend = createAstBackEnd();
-			backend->addPass(new AstRemoveUndef);
-			backend->addPass(new AstConsecutiveCombiner);
-			backend->addPass(new AstNestedCombiner);
-			backend->addPass(new AstConsecutiveCombiner);
+			// Phase 3: make into functions with arguments, run codegen.
+			// With several workers, runs of consecutive function passes go over partitions of the module on every
+			// worker, and everything else runs on this thread.
+			vector<Pass*> passes = takeOptimizeAndTransformPasses();
+			auto isParallel = [&](const Pass* pass)
+			{
+				return workerCount > 1 && FunctionPassPool::canRunInParallel(*pass);
+			};
+			
+			PhaseScope phase("optimization", "Optimization and transformation");
+			auto segmentBegin = passes.begin();
+			while (segmentBegin != passes.end())
+			{
+				bool parallelSegment = isParallel(*segmentBegin);
+				auto segmentEnd = find_if(segmentBegin, passes.end(), [&](const Pass* pass)
+				{
+					return isParallel(pass) != parallelSegment;
+				});
+				
+				vector<Pass*> segment(segmentBegin, segmentEnd);
+				if (parallelSegment)
+				{
+					if (!runFunctionPassesInParallel(module, executable, segment))
+					{
+						for_each(segmentEnd, passes.end(), [](Pass* pass) { delete pass; });
+						errorOutput << getProgramName() << ": couldn't link back the functions optimized in parallel\n";
+						return false;
+					}
+				}
+				else
+				{
+					// The parameter registry is only created for the passes that begin the pipeline. Passes
+					// further down that need it create it again.
+					runPasses(module, executable, segment, segmentBegin == passes.begin());
+				}
+				segmentBegin = segmentEnd;
+			}
+	
+#ifdef FCD_DEBUG
+			if (verifyModule(module, &errorOutput))
+			{
+				// errors!
+				return false;
+			}
+#endif
+			return true;
+		}
+
+		AstBackEnd* createBackEnd(raw_ostream& output, const vector<string>& includedFiles)
+		{
+			// UnwrapReturns happens after value propagation because value propagation doesn't know that calls
+			// are generally not safe to reorder.
+			AstBackEnd* backend = createAstBackEnd(workerCount);
+			backend->setFunctionCache(functionCache.get());
+			backend->addPass(new AstRemoveUndef);
+			backend->addPass(new AstConsecutiveCombiner);
+			backend->addPass(new AstNestedCombiner);
+			backend->addPass(new AstConsecutiveCombiner);
 			backend->addPass(new AstSimplifyExpressions);
 			backend->addPass(new AstMergeCongruentVariables);
 			backend->addPass(new AstConsecutiveCombiner);
 			backend->addPass(new AstNestedCombiner);
 			backend->addPass(new AstConsecutiveCombiner);
-			backend->addPass(new AstPrint(output, md::getIncludedFiles(module)));
+			backend->addPass(new AstPrint(output, includedFiles));
+			return backend;
+		}
+		
+		// cachedOutputs has the pseudocode of functions that were found in the function cache instead of being lifted.
+		bool generateEquivalentPseudocode(Module& module, raw_ostream& output, map<uint64_t, string> cachedOutputs = map<uint64_t, string>())
+		{
+			PrettyStackTraceString pseudocode("Generating pseudo-C output");
+			
+			// Functions that weren't lifted are declared so that their output comes out in address order.
+			unordered_set<uint64_t> addresses;
+			for (Function& fn : module)
+			{
+				if (auto address = md::getVirtualAddress(fn))
+				{
+					addresses.insert(address->getLimitedValue());
+				}
+			}
+			
+			FunctionType* cachedFunctionType = FunctionType::get(Type::getVoidTy(module.getContext()), false);
+			for (const auto& pair : cachedOutputs)
+			{
+				if (addresses.count(pair.first) == 0)
+				{
+					char name[] = "func_0000000000000000";
+					snprintf(name, sizeof name, "func_%" PRIx64, pair.first);
+					Function* cachedFunction = Function::Create(cachedFunctionType, GlobalValue::ExternalLinkage, name, &module);
+					md::setVirtualAddress(*cachedFunction, pair.first);
+				}
+			}
+			
+			// Run that module through the output pass
+			unique_ptr<AstBackEnd> backend(createBackEnd(output, md::getIncludedFiles(module)));
+			backend->setCachedOutputs(move(cachedOutputs));
+			
+			PhaseScope phase("pseudocode", "Pseudocode generation");
 			backend->runOnModule(module);
 			return true;
 		}
 	
+		// Make sure that the module is legal
+		bool isTranslationValid(Module& module)
+		{
+			size_t errorCount = 0;
+			if (Function* assertionFailure = module.getFunction("x86_assertion_failure"))
+			{
+				errorCount += forEachCall(assertionFailure, 0, [](const string& message) {
+					cerr << "translation assertion failure: " << message << endl;
+				});
+			}
+			
+			if (errorCount > 0)
+			{
+				cerr << "incorrect or missing translations; cannot decompile" << endl;
+				return false;
+			}
+			return true;
+		}
+		
+		// Options declared in other files that change the result of a phase can only be found on the command line.
+		void addCommandLineOptions(ModuleCheckpoints::KeyBuilder& key, ArrayRef<StringRef> names)
+		{
+			for (int i = 1; i < argc; ++i)
+			{
+				StringRef argument = argv[i];
+				StringRef name = argument.ltrim('-').split('=').first;
+				if (argument.startswith("-") && std::find(names.begin(), names.end(), name) != names.end())
+				{
+					key.add(argument);
+					if (!argument.contains('=') && i + 1 < argc)
+					{
+						key.add(argv[i + 1]);
+					}
+				}
+			}
+		}
+		
+		void addHeaderInputs(ModuleCheckpoints::KeyBuilder& key)
+		{
+			for (const string& header : headers)
+			{
+				key.addFileContents(header);
+			}
+			for (const string& framework : frameworks)
+			{
+				key.add(framework);
+			}
+			for (const string& searchPath : headerSearchPath)
+			{
+				key.add(searchPath);
+			}
+		}
+		
+		void addOptimizationPipeline(ModuleCheckpoints::KeyBuilder& key)
+		{
+			for (const string& passName : optimizeAndTransformPassNames)
+			{
+				StringRef trimmedName = StringRef(passName).trim();
+				auto ext = sys::path::extension(trimmedName);
+				if (ext == ".py" || ext == ".pyc" || ext == ".pyo")
+				{
+					key.addFileContents(trimmedName);
+				}
+				else
+				{
+					key.add(trimmedName);
+				}
+			}
+			addCommandLineOptions(key, { "cc" });
+		}
+		
+		string getLiftedCheckpointKey(const MemoryBuffer& executableCode)
+		{
+			ModuleCheckpoints::KeyBuilder key;
+			key.add(executableCode.getBuffer());
+			key.add(to_string(partialOptCount()));
+			key.add(to_string(calleeDepth.getValue()));
+			key.add(to_string(liftingBudget.getValue()));
+			for (uint64_t address : set<uint64_t>(additionalEntryPoints.begin(), additionalEntryPoints.end()))
+			{
+				key.add(to_string(address));
+			}
+			addHeaderInputs(key);
+			addCommandLineOptions(key, { "format", "f", "flat-org" });
+			return key.getKey();
+		}
+		
+		string getOptimizedCheckpointKey(StringRef liftedKey)
+		{
+			ModuleCheckpoints::KeyBuilder key;
+			key.add(liftedKey);
+			addOptimizationPipeline(key);
+			return key.getKey();
+		}
+		
+		// Functions are looked up in the function cache before they are lifted, so their key covers everything between
+		// the executable and the pseudocode besides their own code.
+		string getFunctionCachePipeline()
+		{
+			ModuleCheckpoints::KeyBuilder key;
+			key.add(isFullDisassembly() ? "full" : isPartialDisassembly() ? "partial" : "exclusive");
+			key.add(to_string(calleeDepth.getValue()));
+			key.add(to_string(liftingBudget.getValue()));
+			addHeaderInputs(key);
+			addCommandLineOptions(key, { "format", "f", "flat-org" });
+			addOptimizationPipeline(key);
+			unique_ptr<AstBackEnd> backend(createBackEnd(nulls(), vector<string>()));
+			key.add(backend->getPipelineIdentity());
+			return key.getKey();
+		}
+		
+		// Decompiles the executable (or module, with --module-in) at inputPath and writes the result to output.
+		bool decompile(LLVMContext& context, const string& inputPath, raw_ostream& output)
+		{
+			// Python scripts can keep a view of the executable's bytes, so the buffer goes away last.
+			ErrorOr<unique_ptr<MemoryBuffer>> bufferOrError(nullptr);
+			unique_ptr<Executable> executable;
+			unique_ptr<Module> module;
+			string liftedCheckpointKey;
+			string optimizedCheckpointKey;
+			bool isOptimized = false;
+			
+			// Functions found in the function cache before lifting aren't in the module, so it can't be checkpointed.
+			map<uint64_t, string> cachedOutputs;
+			
+			// step one: create annotated module from executable (or load it from .ll)
+			if (moduleInCount())
+			{
+				PrettyStackTraceFormat parsingIR("Parsing IR from \"%s\"", inputPath.c_str());
+				PhaseScope phase("parse", "Input parsing");
+				
+				SMDiagnostic errors;
+				module = parseIRFile(inputPath, errors, context);
+				if (!module)
+				{
+					errors.print(argv[0], errs());
+					return false;
+				}
+			}
+			else
+			{
+				PrettyStackTraceFormat parsingIR("Parsing executable \"%s\"", inputPath.c_str());
+				
+				bufferOrError = mapExecutableFile(inputPath);
+				if (!bufferOrError)
+				{
+					cerr << getProgramName() << ": can't open " << inputPath << ": " << errorOf(bufferOrError) << endl;
+					return false;
+				}
+				
+				ErrorOr<unique_ptr<Executable>> executableOrError(nullptr);
+				{
+					PhaseScope phase("parse", "Input parsing");
+					executableOrError = parseExecutable(*bufferOrError.get());
+				}
+				if (!executableOrError)
+				{
+					cerr << getProgramName() << ": couldn't parse " << inputPath << ": " << errorOf(executableOrError) << endl;
+					return false;
+				}
+				
+				executable = move(executableOrError.get());
+				if (checkpoints)
+				{
+					PhaseScope phase("checkpoint", "Checkpoint loading");
+					liftedCheckpointKey = getLiftedCheckpointKey(*bufferOrError.get());
+					optimizedCheckpointKey = getOptimizedCheckpointKey(liftedCheckpointKey);
+					
+					// Printing the lifted module needs the module from before optimizations.
+					if (moduleOutCount() != 1)
+					{
+						module = checkpoints->load("optimized", optimizedCheckpointKey, context);
+						isOptimized = module != nullptr;
+					}
+					if (!module)
+					{
+						module = checkpoints->load("lifted", liftedCheckpointKey, context);
+					}
+				}
+				
+				if (!module)
+				{
+					string moduleName = sys::path::stem(inputPath);
+					// Functions are only taken from the cache when they end up as pseudocode.
+					auto takeFromCache = moduleOutCount() == 0 ? &cachedOutputs : nullptr;
+					auto moduleOrError = generateAnnotatedModule(context, *executable, moduleName, nullptr, takeFromCache);
+					if (!moduleOrError)
+					{
+						cerr << getProgramName() << ": couldn't build LLVM module out of " << inputPath << ": " << errorOf(moduleOrError) << endl;
+						return false;
+					}
+					
+					module = move(moduleOrError.get());
+					if (checkpoints && cachedOutputs.empty())
+					{
+						checkpoints->store("lifted", liftedCheckpointKey, *module);
+					}
+				}
+			}
+			
+			if (!isTranslationValid(*module))
+			{
+				return false;
+			}
+			
+			// if we want module output, this is where we stop
+			if (moduleOutCount() == 1)
+			{
+				module->print(output, nullptr);
+				return true;
+			}
+			
+			if (moduleInCount() < 2 && !isOptimized)
+			{
+				if (!optimizeAndTransformModule(*module, errs(), executable.get()))
+				{
+					return false;
+				}
+				if (checkpoints && !optimizedCheckpointKey.empty() && cachedOutputs.empty())
+				{
+					checkpoints->store("optimized", optimizedCheckpointKey, *module);
+				}
+			}
+			
+			if (moduleOutCount() > 1)
+			{
+				module->print(output, nullptr);
+				return true;
+			}
+			
+			// step three (final step): emit pseudocode
+			return generateEquivalentPseudocode(*module, output, move(cachedOutputs));
+		}
+		
 		static void initializePasses()
 		{
 			auto& pr = *PassRegistry::getPassRegistry();
@@ -616,13 +1387,13 @@ namespace
 					auto extensionPoint = find(passNames.begin(), passNames.end(), "simplifyconditions") + 1;
 					passNames.insert(extensionPoint, additionalPasses.begin(), additionalPasses.end());
 				}
-				optimizeAndTransformPasses = createPassesFromList(passNames);
+				optimizeAndTransformPassNames = passNames;
 			}
 			else if (customPassPipeline == "")
 			{
 				if (auto editor = getenv("EDITOR"))
 				{
-					optimizeAndTransformPasses = interactivelyEditPassPipeline(editor, passNames);
+					optimizeAndTransformPassNames = interactivelyEditPassPipeline(editor, passNames);
 				}
 				else
 				{
@@ -632,21 +1403,349 @@ namespace
 			}
 			else
 			{
-				optimizeAndTransformPasses = readPassPipelineFromString(customPassPipeline);
+				optimizeAndTransformPassNames = readPassPipelineFromString(customPassPipeline);
+			}
+			
+			optimizeAndTransformPasses = createPassesFromList(optimizeAndTransformPassNames);
+			if (functionCache)
+			{
+				functionCachePipeline = getFunctionCachePipeline();
 			}
 			return optimizeAndTransformPasses.size() > 0;
 		}
+		
+		bool usesPythonPasses() const
+		{
+			return any_of(optimizeAndTransformPassNames.begin(), optimizeAndTransformPassNames.end(), [](const string& passName)
+			{
+				auto ext = sys::path::extension(StringRef(passName).trim());
+				return ext == ".py" || ext == ".pyc" || ext == ".pyo";
+			});
+		}
 	};
 }
 
+namespace
+{
+	struct BatchInput
+	{
+		string inputPath;
+		string outputPath;
+	};
+	
+	bool readBatchList(const string& listPath, vector<BatchInput>& inputs)
+	{
+		auto bufferOrError = MemoryBuffer::getFile(listPath);
+		if (!bufferOrError)
+		{
+			errs() << "can't open " << listPath << ": " << bufferOrError.getError().message() << '\n';
+			return false;
+		}
+		
+		SmallVector<StringRef, 16> lines;
+		bufferOrError.get()->getBuffer().split(lines, '\n', -1, false);
+		for (StringRef line : lines)
+		{
+			line = line.rtrim("\r");
+			if (line.empty() || line[0] == '#')
+			{
+				continue;
+			}
+			
+			StringRef input, output;
+			tie(input, output) = line.split('\t');
+			inputs.emplace_back();
+			inputs.back().inputPath = input.str();
+			inputs.back().outputPath = output.empty() ? (input + (moduleOutCount() > 0 ? ".ll" : ".c")).str() : output.str();
+		}
+		return true;
+	}
+	
+	// State that --serve keeps between requests. Functions are lifted as with --partial, as if each request added an
+	// --other-entry, and the optimized module of every function that was asked for stays in memory.
+	class ServerSession
+	{
+		struct DecompiledFunction
+		{
+			unique_ptr<Module> module;
+			string ir;
+			string pseudocode;
+		};
+		
+		Main& mainObj;
+		LLVMContext context;
+		
+		// Keeps the emulator module of this context loaded between requests.
+		shared_ptr<CodeGenerator> codeGenerator;
+		
+		// Parsed once per executable. Prototypes go into the module that is being lifted. The declarations are created
+		// against headerModule, which only gives them the target, and which must outlive them.
+		unique_ptr<Module> headerModule;
+		unique_ptr<HeaderDeclarations> executableHeaders;
+		vector<unsigned long long> commandLineEntryPoints;
+		unique_ptr<MemoryBuffer> executableCode;
+		unique_ptr<Executable> executable;
+		string moduleName;
+		map<uint64_t, DecompiledFunction> functions;
+		
+		bool load(StringRef path, string& output)
+		{
+			auto bufferOrError = mapExecutableFile(path);
+			if (!bufferOrError)
+			{
+				output = "can't open " + path.str() + ": " + errorOf(bufferOrError);
+				return false;
+			}
+			
+			auto executableOrError = mainObj.parseExecutable(*bufferOrError.get());
+			if (!executableOrError)
+			{
+				output = "couldn't parse " + path.str() + ": " + errorOf(executableOrError);
+				return false;
+			}
+			
+			// Header declarations only use this module for its target until they are given the module of a function.
+			unique_ptr<Module> parsedHeaderModule(new Module(sys::path::stem(path), context));
+			parsedHeaderModule->setTargetTriple(executableOrError.get()->getTargetTriple());
+			auto parsedHeaders = mainObj.parseHeaders(*parsedHeaderModule);
+			if (!parsedHeaders)
+			{
+				output = "couldn't parse headers";
+				return false;
+			}
+			
+			// Modules of the previous executable can refer to it, so they go first.
+			functions.clear();
+			executableHeaders = move(parsedHeaders);
+			headerModule = move(parsedHeaderModule);
+			executable = move(executableOrError.get());
+			executableCode = move(bufferOrError.get());
+			moduleName = sys::path::stem(path);
+			return true;
+		}
+		
+		DecompiledFunction* getFunction(StringRef addressString, string& output)
+		{
+			uint64_t address;
+			if (addressString.getAsInteger(0, address))
+			{
+				output = "expected an address";
+				return nullptr;
+			}
+			if (!executable)
+			{
+				output = "no executable loaded";
+				return nullptr;
+			}
+			
+			auto iter = functions.find(address);
+			if (iter != functions.end())
+			{
+				return &iter->second;
+			}
+			
+			additionalEntryPoints.clear();
+			for (unsigned long long entryPoint : commandLineEntryPoints)
+			{
+				additionalEntryPoints.push_back(entryPoint);
+			}
+			additionalEntryPoints.push_back(address);
+			
+			auto moduleOrError = mainObj.generateAnnotatedModule(context, *executable, moduleName, executableHeaders.get());
+			if (!moduleOrError)
+			{
+				output = "couldn't lift function: " + errorOf(moduleOrError);
+				return nullptr;
+			}
+			
+			unique_ptr<Module> module = move(moduleOrError.get());
+			if (!mainObj.isTranslationValid(*module))
+			{
+				output = "incorrect or missing translations; cannot decompile";
+				return nullptr;
+			}
+			
+			string errors;
+			raw_string_ostream errorStream(errors);
+			if (!mainObj.optimizeAndTransformModule(*module, errorStream, executable.get()))
+			{
+				output = "couldn't optimize function: " + errorStream.str();
+				return nullptr;
+			}
+			
+			DecompiledFunction& function = functions[address];
+			raw_string_ostream(function.ir) << *module;
+			function.module = move(module);
+			return &function;
+		}
+		
+	public:
+		ServerSession(Main& mainObj)
+		: mainObj(mainObj), codeGenerator(CodeGenerator::x86(context)), commandLineEntryPoints(additionalEntryPoints.begin(), additionalEntryPoints.end())
+		{
+		}
+		
+		bool handle(const DecompilationServer::Request& request, string& output)
+		{
+			auto field = [&](const char* name)
+			{
+				auto iter = request.find(name);
+				return iter == request.end() ? StringRef() : StringRef(iter->second);
+			};
+			
+			StringRef command = field("command");
+			if (command == "load")
+			{
+				return load(field("path"), output);
+			}
+			else if (command == "decompile" || command == "ir")
+			{
+				DecompiledFunction* function = getFunction(field("address"), output);
+				if (function == nullptr)
+				{
+					return false;
+				}
+				
+				// The back-end can change the module, so IR is printed before and pseudocode is only generated once.
+				if (command == "decompile" && function->pseudocode.empty())
+				{
+					string pseudocode;
+					raw_string_ostream pseudocodeStream(pseudocode);
+					if (!mainObj.generateEquivalentPseudocode(*function->module, pseudocodeStream))
+					{
+						output = "couldn't generate pseudocode";
+						return false;
+					}
+					function->pseudocode = pseudocodeStream.str();
+				}
+				output = command == "ir" ? function->ir : function->pseudocode;
+				return true;
+			}
+			
+			output = "unknown command \"" + command.str() + "\"";
+			return false;
+		}
+	};
+	
+	bool decompileBatchInput(Main& mainObj, const BatchInput& input)
+	{
+		error_code error;
+		raw_fd_ostream output(input.outputPath, error, sys::fs::F_Text);
+		if (error)
+		{
+			errs() << mainObj.getProgramName() << ": can't open " << input.outputPath << ": " << error.message() << '\n';
+			return false;
+		}
+		
+		bool success;
+		{
+			LLVMContext context;
+			success = mainObj.decompile(context, input.inputPath, output);
+		}
+		output.close();
+		if (output.has_error())
+		{
+			output.clear_error();
+			errs() << mainObj.getProgramName() << ": couldn't write " << input.outputPath << '\n';
+			success = false;
+		}
+		
+		if (!success)
+		{
+			sys::fs::remove(input.outputPath);
+		}
+		return success;
+	}
+	
+	// Inputs are independent: each one gets its own LLVMContext, and they share the Python interpreter, the pass
+	// registry, the pass pipeline and (through the header cache) the parsed headers. --jobs sets how many inputs are
+	// decompiled at once; each input is then decompiled on a single thread.
+	bool decompileBatch(Main& mainObj, const string& listPath)
+	{
+		vector<BatchInput> inputs;
+		if (!readBatchList(listPath, inputs))
+		{
+			return false;
+		}
+		
+		unsigned jobs = min(getWorkerCount(), static_cast<unsigned>(max<size_t>(inputs.size(), 1)));
+		if (mainObj.usesPythonPasses() || Executable::isScripted())
+		{
+			// The Python interpreter can only be used from one thread at a time.
+			jobs = 1;
+		}
+		
+		if (jobs > 1 && isTimingPhases())
+		{
+			errs() << mainObj.getProgramName() << ": --" << timePhases.ArgStr << " needs --" << jobCount.ArgStr << "=1 in batch mode\n";
+			return false;
+		}
+		
+		// Headers are parsed once and then loaded from the cache by every input.
+		SmallString<128> temporaryHeaderCache;
+		if (headers.size() > 0 && headerCacheDirectory.empty())
+		{
+			if (!sys::fs::createUniqueDirectory("fcd-headers", temporaryHeaderCache))
+			{
+				mainObj.setHeaderCacheDirectory(temporaryHeaderCache.str());
+			}
+		}
+		
+		// Lazily-computed option state and Capstone's global initialization aren't thread-safe, so take care of them
+		// before starting workers.
+		partialOptCount();
+		moduleInCount();
+		moduleOutCount();
+		capstone::create(CS_ARCH_X86, static_cast<unsigned>(CS_MODE_LITTLE_ENDIAN | CS_MODE_64));
+		mainObj.setWorkerCount(1);
+		
+		atomic<size_t> next(0);
+		atomic<size_t> failures(0);
+		auto work = [&]
+		{
+			for (size_t index = next++; index < inputs.size(); index = next++)
+			{
+				if (!decompileBatchInput(mainObj, inputs[index]))
+				{
+					failures++;
+				}
+			}
+		};
+		
+		vector<thread> workers;
+		for (unsigned i = 1; i < jobs; ++i)
+		{
+			workers.emplace_back(work);
+		}
+		work();
+		for (thread& worker : workers)
+		{
+			worker.join();
+		}
+		
+		if (temporaryHeaderCache.size() > 0)
+		{
+			sys::fs::remove_directories(temporaryHeaderCache);
+		}
+		
+		if (failures > 0)
+		{
+			errs() << mainObj.getProgramName() << ": " << failures.load() << " of " << inputs.size() << " inputs could not be decompiled\n";
+			return false;
+		}
+		return true;
+	}
+}
+
+// --serve only lifts the functions that requests ask for.
 bool isFullDisassembly()
 {
-	return partialOptCount() < 1;
+	return partialOptCount() < 1 && serveSocket.empty();
 }
 
 bool isPartialDisassembly()
 {
-	return partialOptCount() == 1;
+	return partialOptCount() == 1 || (partialOptCount() < 1 && !serveSocket.empty());
 }
 
 bool isExclusiveDisassembly()
@@ -670,6 +1769,19 @@ int main(int argc, char** argv)
 	pruneOptionList(cl::getRegisteredOptions());
 	cl::ParseCommandLineOptions(argc, argv, "native program decompiler");
 	
+	int modeCount = !inputFile.empty() + !batchListFile.empty() + !serveSocket.empty();
+	if (modeCount != 1)
+	{
+		errs() << sys::path::filename(argv[0]) << ": expected one of an input program, a --" << batchListFile.ArgStr << " list or a --" << serveSocket.ArgStr << " socket\n";
+		return 1;
+	}
+	
+	if (!serveSocket.empty() && (moduleInCount() || moduleOutCount()))
+	{
+		errs() << sys::path::filename(argv[0]) << ": --" << serveSocket.ArgStr << " takes executables; ask for IR with the \"ir\" command\n";
+		return 1;
+	}
+	
 	if (customPassPipeline != "default" && additionalPasses.size() > 0)
 	{
 		errs() << sys::path::filename(argv[0]) << ": additional passes only accepted when using the default pipeline\n";
@@ -679,8 +1791,8 @@ int main(int argc, char** argv)
 	
 	Main::initializePasses();
 	
+	PhaseReport phaseReport;
 	Main mainObj(argc, argv);
-	string program = mainObj.getProgramName();
 	
 	// step 0: before even attempting anything, prepare optimization passes
 	// (the user won't be happy if we work for 5 minutes only to discover that the optimization passes don't load)
@@ -689,89 +1801,26 @@ int main(int argc, char** argv)
 		return 1;
 	}
 	
-	unique_ptr<Executable> executable;
-	unique_ptr<Module> module;
-	
-	// step one: create annotated module from executable (or load it from .ll)
-	ErrorOr<unique_ptr<MemoryBuffer>> bufferOrError(nullptr);
-	if (moduleInCount())
+	bool success;
+	if (batchListFile.size() > 0)
 	{
-		PrettyStackTraceFormat parsingIR("Parsing IR from \"%s\"", inputFile.c_str());
-		
-		SMDiagnostic errors;
-		module = parseIRFile(inputFile, errors, mainObj.getContext());
-		if (!module)
-		{
-			errors.print(argv[0], errs());
-			return 1;
-		}
+		success = decompileBatch(mainObj, batchListFile);
 	}
-	else
+	else if (serveSocket.size() > 0)
 	{
-		PrettyStackTraceFormat parsingIR("Parsing executable \"%s\"", inputFile.c_str());
-		
-		bufferOrError = MemoryBuffer::getFile(inputFile, -1, false);
-		if (!bufferOrError)
+		ServerSession session(mainObj);
+		DecompilationServer server(serveSocket, [&](const DecompilationServer::Request& request, string& output)
 		{
-			cerr << program << ": can't open " << inputFile << ": " << errorOf(bufferOrError) << endl;
-			return 1;
-		}
-		
-		auto executableOrError = mainObj.parseExecutable(*bufferOrError.get());
-		if (!executableOrError)
-		{
-			cerr << program << ": couldn't parse " << inputFile << ": " << errorOf(executableOrError) << endl;
-			return 1;
-		}
-		
-		executable = move(executableOrError.get());
-		string moduleName = sys::path::stem(inputFile);
-		auto moduleOrError = mainObj.generateAnnotatedModule(*executable, moduleName);
-		if (!moduleOrError)
-		{
-			cerr << program << ": couldn't build LLVM module out of " << inputFile << ": " << errorOf(moduleOrError) << endl;
-			return 1;
-		}
-		
-		module = move(moduleOrError.get());
-	}
-	
-	// Make sure that the module is legal
-	size_t errorCount = 0;
-	if (Function* assertionFailure = module->getFunction("x86_assertion_failure"))
-	{
-		errorCount += forEachCall(assertionFailure, 0, [](const string& message) {
-			cerr << "translation assertion failure: " << message << endl;
+			return session.handle(request, output);
 		});
+		success = server.run();
 	}
-	
-	if (errorCount > 0)
-	{
-		cerr << "incorrect or missing translations; cannot decompile" << endl;
-		return 1;
-	}
-	
-	// if we want module output, this is where we stop
-	if (moduleOutCount() == 1)
-	{
-		module->print(outs(), nullptr);
-		return 0;
-	}
-	
-	if (moduleInCount() < 2)
-	{
-		if (!mainObj.optimizeAndTransformModule(*module, errs(), executable.get()))
-		{
-			return 1;
-		}
-	}
-	
-	if (moduleOutCount() > 1)
+	else
 	{
-		module->print(outs(), nullptr);
-		return 0;
+		LLVMContext context;
+		success = mainObj.decompile(context, inputFile, outs());
 	}
 	
-	// step three (final step): emit pseudocode
-	return mainObj.generateEquivalentPseudocode(*module, outs()) ? 0 : 1;
+	mainObj.printFunctionCacheStatistics();
+	return success ? 0 : 1;
 }
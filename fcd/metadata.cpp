@@ -33,6 +33,21 @@ namespace
 		}
 		return false;
 	}
+	
+	const char* metadataKinds[] = {
+		"fcd.asm",
+		"fcd.cachekey",
+		"fcd.callinfo",
+		"fcd.funver",
+		"fcd.prgmem",
+		"fcd.prototype",
+		"fcd.recoverable",
+		"fcd.registers",
+		"fcd.stackframe",
+		"fcd.stackptr",
+		"fcd.stub",
+		"fcd.vaddr",
+	};
 }
 
 void md::ensureFunctionBody(Function& fn)
@@ -54,6 +69,14 @@ void md::ensureFunctionBody(Function& fn)
 	}
 }
 
+void md::registerKinds(LLVMContext& ctx)
+{
+	for (const char* kind : metadataKinds)
+	{
+		ctx.getMDKindID(kind);
+	}
+}
+
 vector<string> md::getIncludedFiles(Module& module)
 {
 	vector<string> result;
@@ -178,6 +201,30 @@ MDString* md::getAssemblyString(const Function& fn)
 	return nullptr;
 }
 
+MDString* md::getCacheKey(const Function& fn)
+{
+	if (auto node = fn.getMetadata("fcd.cachekey"))
+	{
+		if (auto keyNode = dyn_cast<MDString>(node->getOperand(0)))
+		{
+			return keyNode;
+		}
+	}
+	return nullptr;
+}
+
+MDString* md::getRecoveredCallInformation(const Function& fn)
+{
+	if (auto node = fn.getMetadata("fcd.callinfo"))
+	{
+		if (auto callInfoNode = dyn_cast<MDString>(node->getOperand(0)))
+		{
+			return callInfoNode;
+		}
+	}
+	return nullptr;
+}
+
 void md::addIncludedFiles(Module& module, const vector<string>& includedFiles)
 {
 	LLVMContext& ctx = module.getContext();
@@ -263,6 +310,22 @@ void md::setAssemblyString(Function &fn, StringRef assembly)
 	fn.setMetadata("fcd.asm", asmNode);
 }
 
+void md::setCacheKey(Function& fn, StringRef key)
+{
+	ensureFunctionBody(fn);
+	LLVMContext& ctx = fn.getContext();
+	MDNode* keyNode = MDNode::get(ctx, MDString::get(ctx, key));
+	fn.setMetadata("fcd.cachekey", keyNode);
+}
+
+void md::setRecoveredCallInformation(Function& fn, StringRef callInfo)
+{
+	ensureFunctionBody(fn);
+	LLVMContext& ctx = fn.getContext();
+	MDNode* callInfoNode = MDNode::get(ctx, MDString::get(ctx, callInfo));
+	fn.setMetadata("fcd.callinfo", callInfoNode);
+}
+
 void md::setStackFrame(AllocaInst &alloca)
 {
 	setFlag(alloca, "fcd.stackframe");
@@ -301,6 +364,14 @@ void md::copy(const Function& from, Function& to)
 	{
 		setArgumentsRecoverable(to);
 	}
+	if (auto key = getCacheKey(from))
+	{
+		setCacheKey(to, key->getString());
+	}
+	if (auto callInfo = getRecoveredCallInformation(from))
+	{
+		setRecoveredCallInformation(to, callInfo->getString());
+	}
 }
 
 bool md::isRegisterStruct(const Value &value)
@@ -337,31 +408,51 @@ void md::setRegisterStruct(AllocaInst& alloca, bool registerStruct)
 
 void md::setRecoveredReturnFieldNames(Module& module, StructType& returnType, const CallInformation& callInfo)
 {
-	LLVMContext& ctx = module.getContext();
-	
-	string key;
-	bool result = getMdNameForType(returnType, key);
-	assert(result); (void) result;
-	
-	auto mdNode = module.getOrInsertNamedMetadata(key);
+	vector<string> fieldNames;
 	for (const ValueInformation& vi : callInfo.returns())
 	{
-		MDString* operand = nullptr;
 		if (vi.type == ValueInformation::IntegerRegister)
 		{
-			operand = MDString::get(ctx, vi.registerInfo->name);
+			fieldNames.push_back(vi.registerInfo->name);
 		}
 		else if (vi.type == ValueInformation::Stack)
 		{
 			string fieldName;
 			raw_string_ostream(fieldName) << "sp" << vi.frameBaseOffset;
-			operand = MDString::get(ctx, fieldName);
+			fieldNames.push_back(move(fieldName));
 		}
 		else
 		{
 			llvm_unreachable("not implemented");
 		}
-		mdNode->addOperand(MDNode::get(ctx, operand));
+	}
+	setRecoveredReturnFieldNames(module, returnType, fieldNames);
+}
+
+void md::setRecoveredReturnFieldNames(Module& module, StructType& returnType, ArrayRef<string> fieldNames)
+{
+	LLVMContext& ctx = module.getContext();
+	
+	string key;
+	bool result = getMdNameForType(returnType, key);
+	assert(result); (void) result;
+	
+	auto mdNode = module.getOrInsertNamedMetadata(key);
+	for (const string& fieldName : fieldNames)
+	{
+		mdNode->addOperand(MDNode::get(ctx, MDString::get(ctx, fieldName)));
+	}
+}
+
+void md::removeRecoveredReturnFieldNames(Module& module, StructType& returnType)
+{
+	string key;
+	if (getMdNameForType(returnType, key))
+	{
+		if (auto mdNode = module.getNamedMetadata(key))
+		{
+			module.eraseNamedMetadata(mdNode);
+		}
 	}
 }
 
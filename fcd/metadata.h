@@ -24,6 +24,10 @@ namespace md
 {
 	void ensureFunctionBody(llvm::Function& fn);
 	
+	// Reading metadata by name registers its kind with the context the first time, which can't happen on several threads
+	// at once. Code that reads metadata from worker threads calls this beforehand.
+	void registerKinds(llvm::LLVMContext& ctx);
+	
 	std::vector<std::string> getIncludedFiles(llvm::Module& module);
 	llvm::ConstantInt* getStackPointerArgument(const llvm::Function& fn);
 	llvm::ConstantInt* getVirtualAddress(const llvm::Function& fn);
@@ -33,6 +37,8 @@ namespace md
 	bool areArgumentsRecoverable(const llvm::Function& fn);
 	bool isPrototype(const llvm::Function& fn);
 	llvm::MDString* getAssemblyString(const llvm::Function& fn);
+	llvm::MDString* getCacheKey(const llvm::Function& fn);
+	llvm::MDString* getRecoveredCallInformation(const llvm::Function& fn);
 	bool isStackFrame(const llvm::AllocaInst& alloca);
 	bool isProgramMemory(const llvm::Instruction& value);
 
@@ -45,6 +51,8 @@ namespace md
 	void setStackPointerArgument(llvm::Function& fn, unsigned argIndex);
 	void removeStackPointerArgument(llvm::Function& fn);
 	void setAssemblyString(llvm::Function& fn, llvm::StringRef assembly);
+	void setCacheKey(llvm::Function& fn, llvm::StringRef key);
+	void setRecoveredCallInformation(llvm::Function& fn, llvm::StringRef callInfo);
 	void setStackFrame(llvm::AllocaInst& alloca);
 	void setProgramMemory(llvm::Instruction& value, bool isProgramMemory = true);
 	
@@ -54,6 +62,8 @@ namespace md
 	void setRegisterStruct(llvm::AllocaInst& alloca, bool registerStruct = true);
 	
 	void setRecoveredReturnFieldNames(llvm::Module& module, llvm::StructType& returnType, const CallInformation& callInfo);
+	void setRecoveredReturnFieldNames(llvm::Module& module, llvm::StructType& returnType, llvm::ArrayRef<std::string> fieldNames);
+	void removeRecoveredReturnFieldNames(llvm::Module& module, llvm::StructType& returnType);
 	llvm::StringRef getRecoveredReturnFieldName(llvm::Module& module, llvm::StructType& returnType, unsigned i);
 }
 
@@ -0,0 +1,139 @@
+//
+// module_checkpoints.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "module_checkpoints.h"
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	// Bump when the contents of a checkpoint change for the same key.
+	const char checkpointMagic[] = "fcd-checkpoint-1";
+}
+
+ModuleCheckpoints::KeyBuilder::KeyBuilder()
+{
+	add(checkpointMagic);
+}
+
+void ModuleCheckpoints::KeyBuilder::add(StringRef data)
+{
+	uint64_t size = data.size();
+	hash.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&size), sizeof size));
+	hash.update(data);
+}
+
+void ModuleCheckpoints::KeyBuilder::addFileContents(StringRef path)
+{
+	add(path);
+	if (auto bufferOrError = MemoryBuffer::getFile(path))
+	{
+		add(bufferOrError.get()->getBuffer());
+	}
+	else
+	{
+		add(bufferOrError.getError().message());
+	}
+}
+
+string ModuleCheckpoints::KeyBuilder::getKey()
+{
+	MD5::MD5Result result;
+	hash.final(result);
+	SmallString<32> digest;
+	MD5::stringifyResult(result, digest);
+	return digest.str();
+}
+
+ModuleCheckpoints::ModuleCheckpoints(string directory)
+: directory(move(directory))
+{
+}
+
+string ModuleCheckpoints::getPath(StringRef phase, StringRef key) const
+{
+	SmallString<128> path(directory);
+	sys::path::append(path, key + "." + phase + ".bc");
+	return path.str();
+}
+
+unique_ptr<Module> ModuleCheckpoints::load(StringRef phase, StringRef key, LLVMContext& context) const
+{
+	string path = getPath(phase, key);
+	auto bufferOrError = MemoryBuffer::getFile(path);
+	if (!bufferOrError)
+	{
+		return nullptr;
+	}
+	
+	// Every phase reads every function, so there is nothing to gain from leaving functions unmaterialized, but loading
+	// lazily catches truncated files before anything is materialized.
+	auto moduleOrError = getOwningLazyBitcodeModule(move(bufferOrError.get()), context);
+	if (!moduleOrError)
+	{
+		logAllUnhandledErrors(moduleOrError.takeError(), errs(), "ignoring checkpoint " + path + ": ");
+		return nullptr;
+	}
+	
+	unique_ptr<Module> module = move(moduleOrError.get());
+	if (Error error = module->materializeAll())
+	{
+		logAllUnhandledErrors(move(error), errs(), "ignoring checkpoint " + path + ": ");
+		return nullptr;
+	}
+	
+	if (verifyModule(*module, &errs()))
+	{
+		errs() << "ignoring checkpoint " << path << ": module is invalid\n";
+		return nullptr;
+	}
+	return module;
+}
+
+bool ModuleCheckpoints::store(StringRef phase, StringRef key, const Module& module) const
+{
+	if (sys::fs::create_directories(directory))
+	{
+		return false;
+	}
+	
+	// Write to a temporary file and move it in place, so that concurrent fcd processes never see a partial checkpoint.
+	string path = getPath(phase, key);
+	int fd;
+	SmallString<128> tempPath;
+	if (sys::fs::createUniqueFile(path + "-%%%%%%%%", fd, tempPath))
+	{
+		return false;
+	}
+	
+	bool written;
+	{
+		raw_fd_ostream checkpointOutput(fd, true);
+		WriteBitcodeToFile(&module, checkpointOutput);
+		checkpointOutput.close();
+		written = !checkpointOutput.has_error();
+		checkpointOutput.clear_error();
+	}
+	
+	if (!written || sys::fs::rename(tempPath, path))
+	{
+		sys::fs::remove(tempPath);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,51 @@
+//
+// module_checkpoints.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__module_checkpoints_h
+#define fcd__module_checkpoints_h
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MD5.h>
+
+#include <memory>
+#include <string>
+
+// Keeps bitcode copies of the module after decompilation phases, so that a later run can skip the phases whose input
+// didn't change. Checkpoints are keyed on whatever the caller says that the phase depends on. They know nothing about
+// changes to fcd itself, so the directory should be cleared after changing the code of a phase that they cover.
+// Methods can be called from several threads and several processes at once.
+class ModuleCheckpoints
+{
+	std::string directory;
+	
+	std::string getPath(llvm::StringRef phase, llvm::StringRef key) const;
+
+public:
+	class KeyBuilder
+	{
+		llvm::MD5 hash;
+	
+	public:
+		KeyBuilder();
+		
+		void add(llvm::StringRef data);
+		void addFileContents(llvm::StringRef path);
+		std::string getKey();
+	};
+	
+	ModuleCheckpoints(std::string directory);
+	
+	// Returns nullptr if there is no checkpoint for this phase and key, or if it can't be read or isn't valid.
+	std::unique_ptr<llvm::Module> load(llvm::StringRef phase, llvm::StringRef key, llvm::LLVMContext& context) const;
+	bool store(llvm::StringRef phase, llvm::StringRef key, const llvm::Module& module) const;
+};
+
+#endif /* fcd__module_checkpoints_h */
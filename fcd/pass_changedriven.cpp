@@ -0,0 +1,193 @@
+//
+// pass_changedriven.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "metadata.h"
+#include "passes.h"
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/IR/LegacyPassManagers.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+using namespace llvm;
+using namespace std;
+
+#define DEBUG_TYPE "changedriven"
+
+STATISTIC(NumFunctionPassesRun, "Number of times that a function pass ran on a function");
+STATISTIC(NumFunctionPassesSkipped, "Number of times that a function pass was skipped on an unchanged function");
+
+namespace
+{
+	// Remembers which functions a pass ran on without changing them, and at which function version. Function versions
+	// only say what happened to a function under function passes; passes of other kinds can change any function (or
+	// delete it and let its address be reused), so they start a new epoch that forgets everything.
+	class FunctionChangeTracker
+	{
+		struct UnchangedRun
+		{
+			unsigned epoch;
+			unsigned version;
+		};
+		
+		map<pair<const void*, string>, unsigned> passIndices;
+		DenseMap<pair<unsigned, const Function*>, UnchangedRun> unchangedRuns;
+		unsigned epoch;
+	
+	public:
+		FunctionChangeTracker()
+		: epoch(0)
+		{
+		}
+		
+		// Python passes all share the same pass ID, so they are told apart by name.
+		unsigned getPassIndex(const Pass& pass)
+		{
+			auto key = make_pair(pass.getPassID(), pass.getPassName().str());
+			return passIndices.insert({key, static_cast<unsigned>(passIndices.size())}).first->second;
+		}
+		
+		void startEpoch()
+		{
+			++epoch;
+		}
+		
+		bool isUnchanged(unsigned passIndex, const Function& fn) const
+		{
+			auto iter = unchangedRuns.find({passIndex, &fn});
+			return iter != unchangedRuns.end() && iter->second.epoch == epoch && iter->second.version == md::getFunctionVersion(fn);
+		}
+		
+		void setUnchanged(unsigned passIndex, const Function& fn)
+		{
+			unchangedRuns[{passIndex, &fn}] = { epoch, md::getFunctionVersion(fn) };
+		}
+	};
+	
+	// Runs a function pass only on functions that changed since it last ran on them without changing anything. A pass
+	// that changed a function runs again next time, since not every pass reaches a fixpoint in one run.
+	struct ChangeDrivenFunctionPass final : public FunctionPass
+	{
+		static char ID;
+		unique_ptr<FunctionPass> pass;
+		shared_ptr<FunctionChangeTracker> tracker;
+		unsigned passIndex;
+		
+		ChangeDrivenFunctionPass(FunctionPass* pass, shared_ptr<FunctionChangeTracker> tracker)
+		: FunctionPass(ID), pass(pass), tracker(move(tracker)), passIndex(this->tracker->getPassIndex(*pass))
+		{
+		}
+		
+		virtual StringRef getPassName() const override
+		{
+			return pass->getPassName();
+		}
+		
+		virtual void getAnalysisUsage(AnalysisUsage& au) const override
+		{
+			pass->getAnalysisUsage(au);
+		}
+		
+		virtual bool doInitialization(Module& module) override
+		{
+			return pass->doInitialization(module);
+		}
+		
+		virtual bool doFinalization(Module& module) override
+		{
+			return pass->doFinalization(module);
+		}
+		
+		virtual bool runOnFunction(Function& fn) override
+		{
+			if (tracker->isUnchanged(passIndex, fn))
+			{
+				++NumFunctionPassesSkipped;
+				return false;
+			}
+			
+			// The pass manager only knows about the wrapper, so the wrapped pass gets its own resolver that is given
+			// the analyses that the wrapper required on its behalf.
+			PMDataManager& manager = getResolver()->getPMDataManager();
+			if (pass->getResolver() == nullptr)
+			{
+				pass->setResolver(new AnalysisResolver(manager));
+			}
+			manager.initializeAnalysisImpl(pass.get());
+			
+			++NumFunctionPassesRun;
+			if (pass->runOnFunction(fn))
+			{
+				md::incrementFunctionVersion(fn);
+				return true;
+			}
+			
+			tracker->setUnchanged(passIndex, fn);
+			return false;
+		}
+	};
+	
+	struct FunctionChangeBarrier final : public ModulePass
+	{
+		static char ID;
+		shared_ptr<FunctionChangeTracker> tracker;
+		
+		FunctionChangeBarrier(shared_ptr<FunctionChangeTracker> tracker)
+		: ModulePass(ID), tracker(move(tracker))
+		{
+		}
+		
+		virtual StringRef getPassName() const override
+		{
+			return "Function change barrier";
+		}
+		
+		virtual void getAnalysisUsage(AnalysisUsage& au) const override
+		{
+			au.setPreservesAll();
+		}
+		
+		virtual bool runOnModule(Module&) override
+		{
+			tracker->startEpoch();
+			return false;
+		}
+	};
+	
+	char ChangeDrivenFunctionPass::ID = 0;
+	char FunctionChangeBarrier::ID = 0;
+}
+
+vector<Pass*> createChangeDrivenPipeline(const vector<Pass*>& passes)
+{
+	auto tracker = make_shared<FunctionChangeTracker>();
+	vector<Pass*> result;
+	for (Pass* pass : passes)
+	{
+		switch (pass->getPassKind())
+		{
+			case PT_Function:
+				result.push_back(new ChangeDrivenFunctionPass(static_cast<FunctionPass*>(pass), tracker));
+				break;
+			
+			case PT_Immutable:
+				result.push_back(pass);
+				break;
+			
+			default:
+				result.push_back(pass);
+				result.push_back(new FunctionChangeBarrier(tracker));
+				break;
+		}
+	}
+	return result;
+}
@@ -21,6 +21,12 @@
 #include <llvm/Pass.h>
 #include <llvm/Transforms/Utils/MemorySSA.h>
 
+#include <vector>
+
 llvm::FunctionPass*		createRegisterPointerPromotionPass();
 
+// Takes ownership of the passes of a pipeline and returns them with function passes wrapped so that they skip the
+// functions that didn't change since they last ran on them.
+std::vector<llvm::Pass*> createChangeDrivenPipeline(const std::vector<llvm::Pass*>& passes);
+
 #endif /* defined(fcd__passes_h) */
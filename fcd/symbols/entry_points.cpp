@@ -10,7 +10,7 @@
 #include "command_line.h"
 #include "entry_points.h"
 
-#include <unordered_set>
+#include <algorithm>
 
 using namespace llvm;
 using namespace std;
@@ -22,13 +22,17 @@ void EntryPointRepository::addProvider(EntryPointProvider &provider)
 
 vector<uint64_t> EntryPointRepository::getVisibleEntryPoints() const
 {
-	unordered_set<uint64_t> entryPoints;
+	vector<uint64_t> entryPoints;
+	vector<uint64_t> merged;
 	for (auto provider : providers)
 	{
 		auto entryPointList = provider->getVisibleEntryPoints();
-		entryPoints.insert(entryPointList.begin(), entryPointList.end());
+		merged.clear();
+		merged.reserve(entryPoints.size() + entryPointList.size());
+		set_union(entryPoints.begin(), entryPoints.end(), entryPointList.begin(), entryPointList.end(), back_inserter(merged));
+		entryPoints.swap(merged);
 	}
-	return vector<uint64_t>(entryPoints.begin(), entryPoints.end());
+	return entryPoints;
 }
 
 const SymbolInfo* EntryPointRepository::getInfo(uint64_t address) const
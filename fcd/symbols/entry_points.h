@@ -10,19 +10,22 @@
 #ifndef entry_points_h
 #define entry_points_h
 
-#include <cstddef>
-#include <string>
+#include <llvm/ADT/StringRef.h>
+
+#include <cstdint>
 #include <vector>
 
+// The name belongs to the provider that returned the SymbolInfo.
 struct SymbolInfo
 {
-	std::string name;
+	llvm::StringRef name;
 	uint64_t virtualAddress;
 };
 
 class EntryPointProvider
 {
 public:
+	// Sorted by address.
 	virtual std::vector<uint64_t> getVisibleEntryPoints() const = 0;
 	virtual const SymbolInfo* getInfo(uint64_t address) const = 0;
 	
@@ -0,0 +1,74 @@
+//
+// symbol_table.cpp
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#include "symbol_table.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace std;
+
+namespace
+{
+	bool isBefore(const SymbolInfo& symbol, uint64_t address)
+	{
+		return symbol.virtualAddress < address;
+	}
+}
+
+SymbolTable::SymbolTable()
+: sealed(false)
+{
+}
+
+void SymbolTable::add(uint64_t address)
+{
+	assert(!sealed);
+	pending.insert({address, StringRef()});
+}
+
+void SymbolTable::set(uint64_t address, StringRef name)
+{
+	assert(!sealed);
+	pending[address] = name.empty() ? StringRef() : names.insert(name).first->getKey();
+}
+
+void SymbolTable::seal(function_ref<bool(uint64_t)> keep)
+{
+	assert(!sealed);
+	symbols.reserve(pending.size());
+	for (const auto& pair : pending)
+	{
+		if (keep(pair.first))
+		{
+			symbols.push_back({pair.second, pair.first});
+		}
+	}
+	
+	sort(symbols.begin(), symbols.end(), [](const SymbolInfo& a, const SymbolInfo& b)
+	{
+		return a.virtualAddress < b.virtualAddress;
+	});
+	
+	pending.clear();
+	sealed = true;
+}
+
+ArrayRef<SymbolInfo> SymbolTable::getSymbols() const
+{
+	assert(sealed);
+	return symbols;
+}
+
+const SymbolInfo* SymbolTable::find(uint64_t address) const
+{
+	assert(sealed);
+	auto iter = lower_bound(symbols.begin(), symbols.end(), address, isBefore);
+	return iter != symbols.end() && iter->virtualAddress == address ? &*iter : nullptr;
+}
@@ -0,0 +1,49 @@
+//
+// symbol_table.h
+// Copyright (C) 2017 Félix Cloutier.
+// All Rights Reserved.
+//
+// This file is distributed under the University of Illinois Open Source
+// license. See LICENSE.md for details.
+//
+
+#ifndef fcd__symbols_symbol_table_h
+#define fcd__symbols_symbol_table_h
+
+#include "entry_points.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Allocator.h>
+
+#include <unordered_map>
+#include <vector>
+
+// Symbols of an executable, as a flat array sorted by address. Executables add symbols while they are parsed, then
+// seal the table; lookups are binary searches from then on, and the visible entry points are the array itself.
+// Names are interned in the table, which owns them for as long as it lives.
+class SymbolTable
+{
+	llvm::StringSet<llvm::BumpPtrAllocator> names;
+	std::unordered_map<uint64_t, llvm::StringRef> pending;
+	std::vector<SymbolInfo> symbols;
+	bool sealed;
+
+public:
+	SymbolTable();
+	
+	// Adds a symbol without a name, unless there already is a symbol at that address.
+	void add(uint64_t address);
+	
+	// Adds a symbol, or renames the symbol that is already at that address.
+	void set(uint64_t address, llvm::StringRef name);
+	
+	// Sorts the symbols that keep accepts and drops the others. No symbol can be added after that.
+	void seal(llvm::function_ref<bool(uint64_t)> keep);
+	
+	llvm::ArrayRef<SymbolInfo> getSymbols() const;
+	const SymbolInfo* find(uint64_t address) const;
+};
+
+#endif /* fcd__symbols_symbol_table_h */
@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+
+# Checks that the time that fcd takes to lift an instruction doesn't grow with the size of the function that it's in.
+# This builds flat binaries that contain a single function of increasing size, lifts each of them with
+# --time-phases-json, and compares the lifting time per instruction of the largest function with the smallest one.
+# Every group of instructions reads memory, writes memory and branches, so that each one leaves intrinsic calls for
+# CodeGenerator::resolveIntrinsics to replace.
+#
+# Usage: lifting_scaling.py path/to/fcd [--sizes 2000,4000,...] [--runs N] [--tolerance F]
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ORIGIN = 0x400000
+
+# 5 instructions:
+#	mov rax, [rbx+8]
+#	test rax, rax
+#	je +3
+#	add rax, rcx
+#	mov [rbx+0x10], rax
+INSTRUCTION_GROUP = bytearray([
+	0x48, 0x8b, 0x43, 0x08,
+	0x48, 0x85, 0xc0,
+	0x74, 0x03,
+	0x48, 0x01, 0xc8,
+	0x48, 0x89, 0x43, 0x10,
+])
+INSTRUCTIONS_PER_GROUP = 5
+RET = bytearray([0xc3])
+
+def makeFunction(instructionCount):
+	groups = max(instructionCount // INSTRUCTIONS_PER_GROUP, 1)
+	return INSTRUCTION_GROUP * groups + RET, groups * INSTRUCTIONS_PER_GROUP + 1
+
+def timeLifting(fcd, binaryPath, jsonPath):
+	arguments = [
+		fcd, "--format=flat", "--flat-org=%i" % ORIGIN,
+		"--partial", "--other-entry=%i" % ORIGIN,
+		"--module-out", "--time-phases-json=%s" % jsonPath,
+		binaryPath,
+	]
+	with open(os.devnull, "wb") as devnull:
+		subprocess.check_call(arguments, stdout=devnull)
+
+	with open(jsonPath) as jsonFile:
+		report = json.load(jsonFile)
+	return report["time.fcd.lifting.wall"]
+
+def main():
+	parser = argparse.ArgumentParser(description="Check that per-instruction lifting time stays flat as functions grow.")
+	parser.add_argument("fcd", help="path to the fcd executable")
+	parser.add_argument("--sizes", default="2000,4000,8000,16000,32000", help="comma-separated instruction counts")
+	parser.add_argument("--runs", type=int, default=3, help="runs per size; the fastest one is kept")
+	parser.add_argument("--tolerance", type=float, default=2.0, help="largest allowed ratio between the per-instruction time of the largest and smallest functions")
+	args = parser.parse_args()
+
+	sizes = sorted(int(size) for size in args.sizes.split(","))
+	directory = tempfile.mkdtemp(prefix="fcd-lifting-scaling")
+	try:
+		results = []
+		for size in sizes:
+			code, instructionCount = makeFunction(size)
+			binaryPath = os.path.join(directory, "function-%i.bin" % instructionCount)
+			jsonPath = os.path.join(directory, "function-%i.json" % instructionCount)
+			with open(binaryPath, "wb") as binary:
+				binary.write(code)
+
+			seconds = min(timeLifting(args.fcd, binaryPath, jsonPath) for _ in range(args.runs))
+			results.append((instructionCount, seconds))
+	finally:
+		shutil.rmtree(directory)
+
+	print("%12s  %12s  %14s  %8s" % ("Instructions", "Lifting (s)", "us/instruction", "Ratio"))
+	baseline = results[0][1] / results[0][0]
+	for instructionCount, seconds in results:
+		perInstruction = seconds / instructionCount
+		print("%12i  %12.3f  %14.2f  %8.2f" % (instructionCount, seconds, perInstruction * 1e6, perInstruction / baseline))
+
+	ratio = (results[-1][1] / results[-1][0]) / baseline
+	if ratio > args.tolerance:
+		print("lifting time per instruction grew %.2fx from %i to %i instructions (tolerance is %.2fx)" % (ratio, results[0][0], results[-1][0], args.tolerance), file=sys.stderr)
+		return 1
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())